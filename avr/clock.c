@@ -0,0 +1,62 @@
+//*****************************************************************************
+//  Millisecond clock derived from the Timer1 motor PWM cycle.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "clock.h"
+
+// Timer1 counts at F_CPU / 8 (see motor.c)
+#define COUNTS_PER_MS (F_CPU / 8 / 1000)
+#define COUNTS_PER_TICK (COUNTS_PER_MS * CLOCK_MS_PER_TICK)
+
+static volatile uint16_t tick_count = 0;
+
+ISR(TIMER1_OVF_vect)
+{
+    tick_count++;
+}
+
+// Must be called after motor_initialize has started Timer1
+void clock_initialize()
+{
+    tick_count = 0;
+    TIMSK1 |= _BV(TOIE1);
+}
+
+// Number of timer overflows since startup. Wraps every 22 minutes.
+uint16_t clock_ticks()
+{
+    uint16_t ticks = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        ticks = tick_count;
+    }
+
+    return ticks;
+}
+
+// Milliseconds since startup. Wraps every 65 seconds.
+uint16_t clock_ms()
+{
+    uint16_t ticks = 0;
+    uint16_t count = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        ticks = tick_count;
+        count = TCNT1;
+
+        // The counter may have wrapped after interrupts were disabled
+        if ((TIFR1 & _BV(TOV1)) && count < COUNTS_PER_TICK / 2)
+            ticks++;
+    }
+
+    return ticks * CLOCK_MS_PER_TICK + count / COUNTS_PER_MS;
+}
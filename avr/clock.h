@@ -0,0 +1,23 @@
+//*****************************************************************************
+//  Millisecond clock derived from the Timer1 motor PWM cycle.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_CLOCK_H
+#define TANKBOT_CLOCK_H
+
+#include <stdint.h>
+
+// Timer1 overflows at the 50Hz PWM rate set up in motor.c
+#define CLOCK_TICKS_PER_SECOND 50
+#define CLOCK_MS_PER_TICK (1000 / CLOCK_TICKS_PER_SECOND)
+
+void clock_initialize();
+uint16_t clock_ticks();
+uint16_t clock_ms();
+
+#endif
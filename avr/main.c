@@ -7,6 +7,7 @@
 
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#include "clock.h"
 #include "serial.h"
 #include "motor.h"
 
@@ -16,6 +17,7 @@ int main(void)
 {
     serial_initialize();
     motor_initialize();
+    clock_initialize();
 
     // TODO: Disable unused hardware to save power
 
@@ -10,17 +10,34 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <avr/pgmspace.h>
+#include <util/delay.h>
 #include <string.h>
+#include "clock.h"
 #include "serial.h"
 #include "motor.h"
+#include "../framing.h"
 #include "../protocol.h"
 
 const char unknown_packet_fmt[]  PROGMEM = "Unknown packet type '%c' - ignoring";
 const char long_packet_fmt[]     PROGMEM = "Ignoring long packet: %c (length %u)";
+const char short_packet_fmt[]    PROGMEM = "Ignoring short packet: %c (length %u)";
 const char checksum_failed_fmt[] PROGMEM = "Packet checksum failed. Got 0x%02x, expected 0x%02x";
 const char invalid_packet_fmt[] PROGMEM = "Invalid packet end byte. Got 0x%02x, expected 0x%02x";
+const char invalid_frame_fmt[]   PROGMEM = "Invalid frame (length %u) - ignoring";
+const char sequence_gap_fmt[]    PROGMEM = "Lost %u packets before sequence %u";
+const char baud_unconfirmed[]    PROGMEM = "Baud rate change not confirmed - reverting";
+const char baud_idle[]           PROGMEM = "No packets received - reverting baud rate";
+
+// 115.2k in double speed mode
+#define INITIAL_UBRR 16
+
+// Return to the initial rate if a new rate isn't confirmed within
+// this many ticks, or if no packets arrive for this many ticks
+#define BAUD_CONFIRM_TIMEOUT (1 * CLOCK_TICKS_PER_SECOND)
+#define BAUD_IDLE_TIMEOUT (3 * CLOCK_TICKS_PER_SECOND)
 
 static uint8_t input_buffer[256];
 static uint8_t input_read = 0;
@@ -30,6 +47,26 @@ static uint8_t output_buffer[256];
 static volatile uint8_t output_read = 0;
 static volatile uint8_t output_write = 0;
 
+// Framing version used in both directions. Version 1 frames
+// are always accepted so that the server can reset the link.
+static uint8_t framing_version = 1;
+static uint8_t tx_sequence = 0;
+static uint8_t rx_sequence = 0;
+
+// Version 2 frame being received, up to the zero delimiter
+static uint8_t rx_frame[FRAMING_V2_MAX_LENGTH];
+static uint8_t rx_frame_length = 0;
+static bool rx_frame_overflow = false;
+
+// Line rate state
+static uint16_t current_ubrr = INITIAL_UBRR;
+static uint8_t baud_confirm_ticks = 0;
+static uint8_t idle_ticks = 0;
+static uint16_t last_tick = 0;
+
+// Speed packets that arrived after their deadline, reported in pongs
+static uint16_t speeds_expired = 0;
+
 // Add a byte to the send buffer.
 // Will block if the buffer is full
 static void queue_byte(uint8_t b)
@@ -46,53 +83,26 @@ static void queue_byte(uint8_t b)
 // Send data from RAM
 static void queue_data(uint8_t type, const void *data, uint8_t length)
 {
-    // Header
-    queue_byte('$');
-    queue_byte('$');
-    queue_byte(type);
-    queue_byte(length);
-
-    // Data
-    uint8_t checksum = 0;
-    for (uint8_t i = 0; i < length; i++)
-    {
-        uint8_t b = ((uint8_t *)data)[i];
-        queue_byte(b);
-        checksum ^= b;
-    }
-
-    // Footer
-    queue_byte(checksum);
-    queue_byte('\r');
-    queue_byte('\n');
+    uint8_t frame[FRAMING_MAX_LENGTH];
+    uint8_t frame_length;
+    if (framing_version == 2)
+        frame_length = framing_encode_v2(frame, type, tx_sequence++, data, length);
+    else
+        frame_length = framing_encode_v1(frame, type, data, length);
+
+    for (uint8_t i = 0; i < frame_length; i++)
+        queue_byte(frame[i]);
 }
 
 // Send data from flash
 static void queue_data_P(uint8_t type, const void *data, uint8_t length)
 {
-    // Data packet starts with $$ and packet type (which != $)
-    queue_byte('$');
-    queue_byte('$');
-    queue_byte(type);
-
-    // Length of data section
-    queue_byte(length);
+    uint8_t buf[MAX_MESSAGE_LENGTH];
+    if (length > MAX_MESSAGE_LENGTH)
+        length = MAX_MESSAGE_LENGTH;
 
-    // Packet data - calculate checksum as we go
-    uint8_t csm = 0;
-    for (uint8_t i = 0; i < length; i++)
-    {
-        uint8_t b = pgm_read_byte(&((uint8_t *)data)[i]);
-        queue_byte(b);
-        csm ^= b;
-    }
-
-    // Checksum
-    queue_byte(csm);
-
-    // Data packet ends a linefeed and carriage return
-    queue_byte('\r');
-    queue_byte('\n');
+    memcpy_P(buf, data, length);
+    queue_data(type, buf, length);
 }
 
 static bool byte_available()
@@ -125,9 +135,10 @@ ISR(USART0_RX_vect)
 void serial_initialize()
 {
     // Set baud rate to 115.2k
-    UBRR0H = 0;
-    UBRR0L = 16;
+    UBRR0H = INITIAL_UBRR >> 8;
+    UBRR0L = INITIAL_UBRR & 0xFF;
     UCSR0A = _BV(U2X0);
+    current_ubrr = INITIAL_UBRR;
 
     // Enable receive, transmit, data received interrupt
     UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
@@ -136,18 +147,204 @@ void serial_initialize()
     output_read = output_write = 0;
 }
 
-static void parse_packet(enum packet_type type, union packet_data data)
+static void set_framing_version(uint8_t version)
+{
+    framing_version = version;
+    tx_sequence = rx_sequence = 0;
+    rx_frame_length = 0;
+    rx_frame_overflow = false;
+}
+
+// Calculate the double speed mode divisor for a rate,
+// rejecting rates that can't be generated to within 2.5%
+static bool baud_ubrr(uint32_t rate, uint16_t *ubrr)
+{
+    if (rate == 0)
+        return false;
+
+    uint32_t divisor = (F_CPU / 8 + rate / 2) / rate;
+    if (divisor == 0 || divisor > 4096)
+        return false;
+
+    uint32_t actual = F_CPU / 8 / divisor;
+    uint32_t error = actual > rate ? actual - rate : rate - actual;
+    if (error * 40 > rate)
+        return false;
+
+    *ubrr = divisor - 1;
+    return true;
+}
+
+static void set_ubrr(uint16_t ubrr)
+{
+    // Wait for queued data, then for the last byte
+    // to leave the shift register (two byte times)
+    while (output_read != output_write);
+    for (uint16_t i = 0; i <= current_ubrr; i++)
+        _delay_us(160.0 / (F_CPU / 1000000.0));
+
+    UBRR0H = ubrr >> 8;
+    UBRR0L = ubrr & 0xFF;
+    current_ubrr = ubrr;
+
+    // Anything received during the change is garbage
+    input_read = input_write;
+}
+
+static void revert_baud(const char *reason)
+{
+    baud_confirm_ticks = 0;
+    idle_ticks = 0;
+    set_ubrr(INITIAL_UBRR);
+    serial_message_P(reason);
+}
+
+static void parse_baud(const struct packet_baud *baud)
+{
+    struct packet_baud reply = { baud->rate, BAUD_REJECT };
+    uint16_t ubrr;
+
+    switch (baud->stage)
+    {
+    case BAUD_PROPOSE:
+        if (baud_ubrr(baud->rate, &ubrr))
+            reply.stage = BAUD_ACCEPT;
+
+        // Reply at the old rate, then switch
+        queue_data(BAUD, &reply, sizeof(struct packet_baud));
+        if (reply.stage == BAUD_ACCEPT)
+        {
+            set_ubrr(ubrr);
+            baud_confirm_ticks = BAUD_CONFIRM_TIMEOUT;
+        }
+        break;
+    case BAUD_CONFIRM:
+        baud_confirm_ticks = 0;
+        reply.stage = BAUD_CONFIRM;
+        queue_data(BAUD, &reply, sizeof(struct packet_baud));
+        break;
+    }
+}
+
+// True if a speed packet arrived too late to reflect the server's intent
+static bool speed_expired(const struct packet_speed *speed)
 {
+    if (speed->deadline == SPEED_NO_DEADLINE)
+        return false;
+
+    return (int16_t)(clock_ms() - speed->deadline) > 0;
+}
+
+// Called every timer tick to enforce the line rate timeouts
+static void baud_tick()
+{
+    if (baud_confirm_ticks && --baud_confirm_ticks == 0)
+        revert_baud(baud_unconfirmed);
+    else if (current_ubrr != INITIAL_UBRR && ++idle_ticks >= BAUD_IDLE_TIMEOUT)
+        revert_baud(baud_idle);
+}
+
+// Shortest payload accepted for each packet type. Speed packets from
+// servers that predate deadlines omit the deadline field.
+static uint8_t min_packet_length(enum packet_type type)
+{
+    switch (type)
+    {
+    case SPEED:
+        return offsetof(struct packet_speed, deadline);
+    case PING:
+        return sizeof(struct packet_ping);
+    case BAUD:
+        return sizeof(struct packet_baud);
+    case FRAMING:
+        return sizeof(struct packet_framing);
+    default:
+        return 0;
+    }
+}
+
+static void parse_packet(enum packet_type type, union packet_data *data, uint8_t length)
+{
+    idle_ticks = 0;
+
+    if (length < min_packet_length(type))
+    {
+        serial_message_fmt_P(short_packet_fmt, type, length);
+        return;
+    }
+
+    // Don't let a short packet pick up fields left over from the last one
+    memset(&data->bytes[length], 0, sizeof(union packet_data) - length);
+
     switch (type)
     {
     case SPEED:
-        motor_set_speeds(data.speed.left, data.speed.right);
+        if (length < sizeof(struct packet_speed))
+            data->speed.deadline = SPEED_NO_DEADLINE;
+
+        if (speed_expired(&data->speed))
+            speeds_expired++;
+        else
+            motor_set_speeds(data->speed.left, data->speed.right);
+        break;
+    case PING:
+        {
+            struct packet_pong pong = {
+                .timestamp = data->ping.timestamp,
+                .sequence = data->ping.sequence,
+                .clock = clock_ms(),
+                .speeds_expired = speeds_expired
+            };
+            queue_data(PONG, &pong, sizeof(struct packet_pong));
+        }
+        break;
+    case BAUD:
+        parse_baud(&data->baud);
+        break;
+    case FRAMING:
+        {
+            // Acknowledge using the old framing, then switch
+            struct packet_framing reply = { data->framing.version == 2 ? 2 : 1 };
+            queue_data(FRAMING, &reply, sizeof(struct packet_framing));
+            set_framing_version(reply.version);
+        }
         break;
     default:
         serial_message_fmt_P(unknown_packet_fmt, type);
     }
 }
 
+// Accumulate a version 2 frame and parse it once the delimiter arrives
+static void receive_frame_byte(uint8_t b)
+{
+    if (b != FRAMING_V2_DELIMITER)
+    {
+        if (rx_frame_length < sizeof(rx_frame))
+            rx_frame[rx_frame_length++] = b;
+        else
+            rx_frame_overflow = true;
+        return;
+    }
+
+    uint8_t type, sequence, *data;
+    if (rx_frame_length > 0)
+    {
+        int16_t length = rx_frame_overflow ? -1 : framing_decode_v2(rx_frame, rx_frame_length, &type, &sequence, &data);
+        if (length >= 0)
+        {
+            if (sequence != rx_sequence)
+                serial_message_fmt_P(sequence_gap_fmt, (uint8_t)(sequence - rx_sequence), sequence);
+            rx_sequence = sequence + 1;
+            parse_packet(type, (union packet_data *)data, length);
+        }
+        else
+            serial_message_fmt_P(invalid_frame_fmt, rx_frame_length);
+    }
+
+    rx_frame_length = 0;
+    rx_frame_overflow = false;
+}
+
 /*
  * Process any data in the received buffer
  * Parses at most one packet - so must be called frequently
@@ -162,9 +359,22 @@ void serial_tick()
     static uint8_t read = 0;
     static union packet_data data;
 
+    // Catch up on any ticks missed while busy
+    uint16_t ticks = clock_ticks();
+    while (last_tick != ticks)
+    {
+        last_tick++;
+        baud_tick();
+    }
+
     while (byte_available())
     {
         uint8_t b = read_byte();
+        if (framing_version == 2)
+            receive_frame_byte(b);
+
+        // Version 1 errors are expected noise while version 2 is active
+        bool report = framing_version == 1;
         switch (state)
         {
         case 0: // Frame start characters
@@ -187,7 +397,8 @@ void serial_tick()
                 state++;
             else
             {
-                serial_message_fmt_P(long_packet_fmt, type, length);
+                if (report)
+                    serial_message_fmt_P(long_packet_fmt, type, length);
                 state = 0;
             }
             break;
@@ -202,7 +413,8 @@ void serial_tick()
                 state++;
             else
             {
-                serial_message_fmt_P(checksum_failed_fmt, b, checksum);
+                if (report)
+                    serial_message_fmt_P(checksum_failed_fmt, b, checksum);
                 state = 0;
             }
             break;
@@ -211,14 +423,20 @@ void serial_tick()
                 state++;
             else
             {
-                serial_message_fmt_P(invalid_packet_fmt, b, '\r');
+                if (report)
+                    serial_message_fmt_P(invalid_packet_fmt, b, '\r');
                 state = 0;
             }
             break;
         case 7:
             if (b == '\n')
-                parse_packet(type, data);
-            else
+            {
+                // The server has fallen back to version 1
+                if (framing_version != 1)
+                    set_framing_version(1);
+                parse_packet(type, &data, length);
+            }
+            else if (report)
                 serial_message_fmt_P(invalid_packet_fmt, b, '\n');
             state = 0;
             break;
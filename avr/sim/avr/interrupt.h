@@ -0,0 +1,25 @@
+//*****************************************************************************
+//  Host simulator replacement for <avr/interrupt.h>
+//  Interrupt handlers become ordinary functions called by the simulator
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_SIM_AVR_INTERRUPT_H
+#define TANKBOT_SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+
+void USART0_RX_vect(void);
+void USART0_UDRE_vect(void);
+void TIMER1_OVF_vect(void);
+
+void sei(void);
+void cli(void);
+
+#endif
@@ -0,0 +1,68 @@
+//*****************************************************************************
+//  Host simulator replacement for <avr/io.h>
+//  Peripheral registers are plain variables defined in hal.c
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_SIM_AVR_IO_H
+#define TANKBOT_SIM_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+// USART0
+// UDR0 is wider than the hardware register so that the simulator
+// can tell whether the transmit interrupt wrote a byte
+extern volatile uint16_t UDR0;
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UCSR0B;
+extern volatile uint8_t UBRR0H;
+extern volatile uint8_t UBRR0L;
+
+#define U2X0 1
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+// Timer1
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t ICR1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint8_t TIFR1;
+extern volatile uint8_t TIMSK1;
+
+#define WGM11 1
+#define COM1B1 5
+#define COM1A1 7
+#define CS11 1
+#define WGM12 3
+#define WGM13 4
+#define TOV1 0
+#define TOIE1 0
+
+// GPIO
+extern volatile uint8_t DDRB;
+extern volatile uint8_t DDRE;
+extern volatile uint8_t DDRH;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t PORTE;
+extern volatile uint8_t PORTH;
+
+#define PB5 5
+#define PB6 6
+#define PE3 3
+#define PE4 4
+#define PE5 5
+#define PH3 3
+
+#endif
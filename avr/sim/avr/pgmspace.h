@@ -0,0 +1,25 @@
+//*****************************************************************************
+//  Host simulator replacement for <avr/pgmspace.h>
+//  Flash and RAM share one address space on the host
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_SIM_AVR_PGMSPACE_H
+#define TANKBOT_SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define vsnprintf_P vsnprintf
+
+#endif
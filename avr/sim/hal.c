@@ -0,0 +1,160 @@
+//*****************************************************************************
+//  Simulated ATmega2560 peripherals for running the firmware on a host
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <pthread.h>
+#include <time.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+#include "hal.h"
+
+volatile uint16_t UDR0;
+volatile uint8_t UCSR0A;
+volatile uint8_t UCSR0B;
+volatile uint8_t UBRR0H;
+volatile uint8_t UBRR0L;
+
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint16_t TCNT1;
+volatile uint16_t ICR1;
+volatile uint16_t OCR1A;
+volatile uint16_t OCR1B;
+volatile uint8_t TIFR1;
+volatile uint8_t TIMSK1;
+
+volatile uint8_t DDRB;
+volatile uint8_t DDRE;
+volatile uint8_t DDRH;
+volatile uint8_t PORTB;
+volatile uint8_t PORTE;
+volatile uint8_t PORTH;
+
+// Skip busy-wait delays (e.g. the 5 second motor startup) for faster testing
+bool hal_skip_delays = false;
+
+static volatile bool interrupts_enabled = false;
+
+// Interrupt handlers never preempt each other on the hardware.
+// The RX and TX handlers also share UDR0, so must not run concurrently.
+static pthread_mutex_t interrupt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void sei(void)
+{
+    interrupts_enabled = true;
+}
+
+void cli(void)
+{
+    interrupts_enabled = false;
+}
+
+void _delay_us(double us)
+{
+    if (hal_skip_delays)
+        return;
+
+    struct timespec ts = {
+        .tv_sec = (time_t)(us / 1e6),
+        .tv_nsec = (long)((us - (time_t)(us / 1e6) * 1e6) * 1e3)
+    };
+    nanosleep(&ts, NULL);
+}
+
+void _delay_ms(double ms)
+{
+    _delay_us(ms * 1e3);
+}
+
+// Baud rate set by the firmware, following the datasheet formula
+uint32_t hal_uart_baud()
+{
+    uint32_t ubrr = ((uint32_t)UBRR0H << 8) | UBRR0L;
+    uint32_t divisor = (UCSR0A & _BV(U2X0)) ? 8 : 16;
+    return F_CPU / (divisor * (ubrr + 1));
+}
+
+// Deliver a received byte to the firmware, as if from the RX interrupt
+void hal_uart_receive(uint8_t b)
+{
+    if (!(UCSR0B & _BV(RXEN0)))
+        return;
+
+    pthread_mutex_lock(&interrupt_mutex);
+    UDR0 = b;
+    if (interrupts_enabled && (UCSR0B & _BV(RXCIE0)))
+        USART0_RX_vect();
+    pthread_mutex_unlock(&interrupt_mutex);
+}
+
+// Run the data register empty interrupt and return the transmitted byte,
+// or -1 if the firmware had nothing to send.
+// UDRIE0 is deliberately not checked: the firmware sets and clears it with
+// non-atomic read-modify-writes, which are only safe on the real hardware
+// because interrupts can't be preempted by the main loop.
+int hal_uart_transmit()
+{
+    if (!interrupts_enabled || !(UCSR0B & _BV(TXEN0)))
+        return -1;
+
+    pthread_mutex_lock(&interrupt_mutex);
+    UDR0 = 0x100;
+    USART0_UDRE_vect();
+    int b = UDR0 < 0x100 ? UDR0 : -1;
+    pthread_mutex_unlock(&interrupt_mutex);
+
+    return b;
+}
+
+uint8_t hal_atomic_begin(void)
+{
+    pthread_mutex_lock(&interrupt_mutex);
+    return 0;
+}
+
+uint8_t hal_atomic_end(void)
+{
+    pthread_mutex_unlock(&interrupt_mutex);
+    return 1;
+}
+
+// Advance Timer1 to the current time, running the overflow interrupt once
+// for each elapsed period. Only the /8 prescaler used by motor.c is modelled.
+void hal_timer_update()
+{
+    static uint64_t start = 0;
+    static uint64_t overflows = 0;
+
+    if (!(TCCR1B & _BV(CS11)))
+        return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (!start)
+        start = now;
+
+    uint64_t counts = (now - start) / (8000000000ULL / F_CPU);
+    uint32_t top = (uint32_t)ICR1 + 1;
+    TCNT1 = counts % top;
+
+    while (overflows < counts / top)
+    {
+        overflows++;
+        pthread_mutex_lock(&interrupt_mutex);
+        if (interrupts_enabled && (TIMSK1 & _BV(TOIE1)))
+        {
+            // Entering the handler clears the flag
+            TIFR1 &= ~_BV(TOV1);
+            TIMER1_OVF_vect();
+        }
+        else
+            TIFR1 |= _BV(TOV1);
+        pthread_mutex_unlock(&interrupt_mutex);
+    }
+}
@@ -0,0 +1,25 @@
+//*****************************************************************************
+//  Simulated ATmega2560 peripherals for running the firmware on a host
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_SIM_HAL_H
+#define TANKBOT_SIM_HAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+extern bool hal_skip_delays;
+
+uint32_t hal_uart_baud();
+void hal_uart_receive(uint8_t b);
+int hal_uart_transmit();
+void hal_timer_update();
+
+#endif
@@ -0,0 +1,351 @@
+//*****************************************************************************
+//  Runs the firmware serial protocol and motor control code on a Linux host,
+//  talking to the server through a pseudo-terminal.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avr/pgmspace.h>
+#include "hal.h"
+#include "../clock.h"
+#include "../serial.h"
+#include "../motor.h"
+
+// Time constant for the wheels to respond to a new PWM setting
+#define MOTOR_TIME_CONSTANT 0.25
+
+// Interval between motor model updates, in ms
+#define MOTOR_UPDATE_INTERVAL 20
+
+static const char debug_startup_complete[] PROGMEM = "Startup complete";
+
+static volatile bool shutdown_requested = false;
+static int master = -1;
+static bool paced = true;
+static bool verbose = false;
+
+// Rates above this corrupt one byte in fifty, emulating a marginal cable
+static uint32_t max_clean_baud = 0;
+static int slave = -1;
+
+static uint64_t bytes_received = 0;
+static uint64_t bytes_sent = 0;
+
+struct motor
+{
+    double target;
+    double speed;
+    double distance;
+};
+
+static void shutdown_handler(int sig)
+{
+    (void)sig;
+    shutdown_requested = true;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t time)
+{
+    struct timespec ts = {
+        .tv_sec = time / 1000000000ULL,
+        .tv_nsec = time % 1000000000ULL
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+// Time taken to transfer one 8N1 byte at the rate set by the firmware
+static uint64_t byte_time_ns()
+{
+    uint32_t baud = hal_uart_baud();
+    return paced && baud ? 10000000000ULL / baud : 0;
+}
+
+// From <asm/termbits.h>, which can't be included alongside <termios.h>
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+// Rate that the server has set on the pty
+static uint32_t line_baud()
+{
+    struct termios2 tio;
+    if (ioctl(slave, TCGETS2, &tio) == -1)
+        return 0;
+    return tio.c_ospeed;
+}
+
+// Corrupt bytes in the way that a real link would: completely if the two
+// ends disagree on the rate, and occasionally if the rate is too high
+static void corrupt(uint8_t *data, size_t length)
+{
+    uint32_t uart = hal_uart_baud();
+    uint32_t line = line_baud();
+    bool mismatch = line && (uart > line * 1.05 || uart < line * 0.95);
+    bool noisy = max_clean_baud && uart > max_clean_baud;
+
+    for (size_t i = 0; i < length; i++)
+        if (mismatch || (noisy && rand() % 50 == 0))
+            data[i] ^= 1 << (rand() % 8);
+}
+
+// Emulates the transmit side of the uart: pulls bytes from the
+// firmware's output buffer at the configured rate
+static void *transmit_thread(void *arg)
+{
+    (void)arg;
+    uint8_t batch[64];
+    size_t length = 0;
+    uint64_t next = now_ns();
+
+    while (!shutdown_requested)
+    {
+        int b = hal_uart_transmit();
+        if (b >= 0)
+            batch[length++] = b;
+
+        uint64_t now = now_ns();
+        if (b >= 0)
+            next = (next > now ? next : now) + byte_time_ns();
+
+        // Flush before waiting, or when the batch is full
+        if (length > 0 && (b < 0 || next > now || length == sizeof(batch)))
+        {
+            corrupt(batch, length);
+            ssize_t ret = write(master, batch, length);
+            if (ret > 0)
+                __atomic_fetch_add(&bytes_sent, ret, __ATOMIC_RELAXED);
+            length = 0;
+        }
+
+        if (b < 0)
+            sleep_until(now + 100000);
+        else if (next > now)
+            sleep_until(next);
+    }
+
+    return NULL;
+}
+
+// Convert the PWM and direction outputs set by motor.c into signed speeds
+static double left_output()
+{
+    double duty = OCR1B / 65535.0;
+    return (PORTE & _BV(PE3)) ? -duty : duty;
+}
+
+static double right_output()
+{
+    double duty = OCR1A / 65535.0;
+    return (PORTE & _BV(PE5)) ? -duty : duty;
+}
+
+static void update_motor(struct motor *motor, double target, double dt)
+{
+    motor->target = target;
+    motor->speed += (target - motor->speed) * (1 - exp(-dt / MOTOR_TIME_CONSTANT));
+    motor->distance += motor->speed * dt;
+}
+
+static void print_usage()
+{
+    printf("Usage: avrsim [-l <link path>] [-f] [-u] [-m <baud>] [-v]\n");
+    printf("  -l <path>   create a symlink to the simulated serial port\n");
+    printf("  -f          fast start: skip firmware delays\n");
+    printf("  -u          unpaced: don't limit transfers to the uart baud rate\n");
+    printf("  -m <baud>   corrupt 2%% of bytes at rates above this\n");
+    printf("  -v          print the motor state every second\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *link_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:fum:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            link_path = optarg;
+            break;
+        case 'f':
+            hal_skip_delays = true;
+            break;
+        case 'u':
+            paced = false;
+            break;
+        case 'm':
+            max_clean_baud = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGINT, shutdown_handler);
+    signal(SIGTERM, shutdown_handler);
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        printf("Failed to create pseudo-terminal: %s\n", strerror(errno));
+        return 1;
+    }
+
+    const char *slave_path = ptsname(master);
+
+    // Hold the slave open so that the master doesn't see a hangup
+    // while the server is disconnected
+    slave = open(slave_path, O_RDWR | O_NOCTTY);
+    if (slave == -1)
+    {
+        printf("Failed to open %s: %s\n", slave_path, strerror(errno));
+        return 1;
+    }
+
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (link_path)
+    {
+        unlink(link_path);
+        if (symlink(slave_path, link_path) == -1)
+        {
+            printf("Failed to create link %s: %s\n", link_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    printf("Simulated AVR on %s\n", link_path ? link_path : slave_path);
+
+    pthread_t transmit;
+    if (pthread_create(&transmit, NULL, transmit_thread, NULL))
+    {
+        printf("Failed to spawn transmit thread\n");
+        return 1;
+    }
+
+    // Equivalent to main.c, but driven by data arriving on the pty
+    serial_initialize();
+    motor_initialize();
+    clock_initialize();
+    sei();
+    serial_message_P(debug_startup_complete);
+
+    struct motor left = {0}, right = {0};
+    uint8_t buffer[256];
+    size_t length = 0, index = 0;
+    uint64_t next_receive = now_ns();
+    uint64_t last_update = now_ns();
+    uint64_t last_report = last_update;
+
+    while (!shutdown_requested)
+    {
+        if (index == length)
+        {
+            struct pollfd pfd = { .fd = master, .events = POLLIN };
+            if (poll(&pfd, 1, MOTOR_UPDATE_INTERVAL) > 0)
+            {
+                ssize_t ret = read(master, buffer, sizeof(buffer));
+                if (ret > 0)
+                {
+                    corrupt(buffer, ret);
+                    length = ret;
+                    index = 0;
+                    bytes_received += ret;
+                }
+            }
+        }
+
+        // Deliver received bytes at the uart rate
+        while (index < length && !shutdown_requested)
+        {
+            uint64_t now = now_ns();
+            if (next_receive > now + 20000)
+                break;
+
+            next_receive = (next_receive > now ? next_receive : now) + byte_time_ns();
+            hal_uart_receive(buffer[index++]);
+            hal_timer_update();
+            serial_tick();
+        }
+
+        if (index < length)
+            sleep_until(next_receive);
+
+        uint64_t now = now_ns();
+        if (now - last_update >= MOTOR_UPDATE_INTERVAL * 1000000ULL)
+        {
+            double dt = (now - last_update) / 1e9;
+            double left_target = left_output();
+            double right_target = right_output();
+
+            if (left_target != left.target || right_target != right.target)
+                printf("Motor setpoint: left %+.3f right %+.3f\n", left_target, right_target);
+
+            update_motor(&left, left_target, dt);
+            update_motor(&right, right_target, dt);
+            last_update = now;
+
+            hal_timer_update();
+            serial_tick();
+        }
+
+        if (verbose && now - last_report >= 1000000000ULL)
+        {
+            printf("Motor speed: left %+.3f right %+.3f; distance: left %.2f right %.2f\n",
+                   left.speed, right.speed, left.distance, right.distance);
+            last_report = now;
+        }
+    }
+
+    pthread_join(transmit, NULL);
+    if (link_path)
+        unlink(link_path);
+
+    close(slave);
+    close(master);
+
+    printf("Received %llu bytes, sent %llu bytes\n", (unsigned long long)bytes_received,
+           (unsigned long long)__atomic_load_n(&bytes_sent, __ATOMIC_RELAXED));
+    return 0;
+}
@@ -0,0 +1,25 @@
+//*****************************************************************************
+//  Host simulator replacement for <util/atomic.h>
+//  Interrupt handlers are excluded using the simulator's interrupt lock
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_SIM_UTIL_ATOMIC_H
+#define TANKBOT_SIM_UTIL_ATOMIC_H
+
+#include <stdint.h>
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+uint8_t hal_atomic_begin(void);
+uint8_t hal_atomic_end(void);
+
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t _atomic_done = hal_atomic_begin(); !_atomic_done; _atomic_done = hal_atomic_end())
+
+#endif
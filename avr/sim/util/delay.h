@@ -0,0 +1,16 @@
+//*****************************************************************************
+//  Host simulator replacement for <util/delay.h>
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_SIM_UTIL_DELAY_H
+#define TANKBOT_SIM_UTIL_DELAY_H
+
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+#endif
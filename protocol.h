@@ -16,14 +16,81 @@ enum packet_type
 {
     MESSAGE = 'M',
     SPEED = 'S',
+    PING = 'P',
+    PONG = 'p',
+    FRAMING = 'F',
+    BAUD = 'B',
     UNKNOWN = '0'
 };
 
+// Deadline value for speeds that never expire
+#define SPEED_NO_DEADLINE 0xFFFF
+
 struct __attribute__((__packed__)) packet_speed
 {
     // using -10000 - 10000 to represent fixed point values -1.0000 - 1.0000
     int16_t left;
     int16_t right;
+
+    // Avr clock time (see packet_pong) after which the avr ignores
+    // the packet, or SPEED_NO_DEADLINE
+    uint16_t deadline;
+};
+
+// Sent by the server to measure the link round-trip time
+struct __attribute__((__packed__)) packet_ping
+{
+    // Server clock in microseconds when the ping was sent
+    uint32_t timestamp;
+    uint16_t sequence;
+};
+
+// Sent by the avr in immediate reply to a ping. The server uses the avr
+// clock reading to translate speed deadlines into avr time.
+struct __attribute__((__packed__)) packet_pong
+{
+    // Copied from the ping
+    uint32_t timestamp;
+    uint16_t sequence;
+
+    // Avr clock in milliseconds when the ping was received.
+    // Wraps every 65 seconds.
+    uint16_t clock;
+
+    // Number of speed packets that arrived after their deadline. Wraps.
+    uint16_t speeds_expired;
+};
+
+// Sent by the server (always using version 1 framing) to request a change
+// of framing version. The avr replies with the version it will use, then
+// switches both directions to that version. A valid version 1 frame from
+// the server always returns the avr to version 1.
+struct __attribute__((__packed__)) packet_framing
+{
+    uint8_t version;
+};
+
+// Line rate used by both ends after a reset
+#define PROTOCOL_INITIAL_BAUD 115200
+
+// Negotiates a faster line rate. The server proposes a rate, and the avr
+// replies BAUD_ACCEPT or BAUD_REJECT at the current rate. After accepting
+// it switches rate and waits for the server to test the link and send
+// BAUD_CONFIRM at the new rate, which it echoes. The avr returns to the
+// initial rate if the confirmation doesn't arrive within a second, or if
+// no valid packets arrive for three seconds at any other rate.
+enum baud_stage
+{
+    BAUD_PROPOSE = 0,
+    BAUD_ACCEPT,
+    BAUD_REJECT,
+    BAUD_CONFIRM
+};
+
+struct __attribute__((__packed__)) packet_baud
+{
+    uint32_t rate;
+    uint8_t stage;
 };
 
 #define MAX_MESSAGE_LENGTH 200
@@ -32,9 +99,16 @@ struct __attribute__((__packed__)) packet_debug
     char message[1];
 };
 
+// Header, type, length, checksum and footer wrap the packet data
+#define PACKET_FRAME_OVERHEAD 7
+
 union packet_data
 {
     struct packet_speed speed;
+    struct packet_ping ping;
+    struct packet_pong pong;
+    struct packet_framing framing;
+    struct packet_baud baud;
     struct packet_debug debug;
 
     // Ensure a suitable minimum length for debug messages
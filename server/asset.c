@@ -0,0 +1,197 @@
+//*****************************************************************************
+//  Static files served over HTTP, loaded into memory at startup
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "asset.h"
+#include "log.h"
+
+// Browsers may reuse their copy for this long (s) without asking again
+#define ASSET_MAX_AGE 3600
+
+// Each asset holds complete HTTP responses, headers included,
+// so that a request is answered with a single write
+struct asset
+{
+    unsigned char *response;
+    size_t response_length;
+    size_t size;
+
+    // NULL if compression doesn't make the asset smaller
+    unsigned char *gzip_response;
+    size_t gzip_response_length;
+    size_t gzip_size;
+};
+
+static unsigned char *read_file(const char *path, size_t *length)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    unsigned char *data = NULL;
+    long size;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        data = malloc(size ? size : 1);
+        if (data && fread(data, 1, size, f) != (size_t)size)
+        {
+            free(data);
+            data = NULL;
+        }
+
+        *length = size;
+    }
+
+    fclose(f);
+    return data;
+}
+
+// Compress data with a gzip header, returning NULL if it doesn't get smaller
+static unsigned char *compress_gzip(const unsigned char *data, size_t length, size_t *gzip_length)
+{
+    z_stream stream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+
+    // 16 + the window size selects a gzip rather than zlib wrapper
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    unsigned char *out = malloc(length);
+    if (out)
+    {
+        stream.next_in = (unsigned char *)data;
+        stream.avail_in = length;
+        stream.next_out = out;
+        stream.avail_out = length;
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        {
+            free(out);
+            out = NULL;
+        }
+
+        *gzip_length = stream.total_out;
+    }
+
+    deflateEnd(&stream);
+    return out;
+}
+
+// 64 bit FNV-1a hash of the content, used as a strong ETag
+static uint64_t hash(const unsigned char *data, size_t length)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static unsigned char *build_response(const char *mimetype, const char *encoding, uint64_t etag,
+                                     const unsigned char *body, size_t length, size_t *response_length)
+{
+    char header[512];
+    int header_length = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\x0d\x0a"
+        "Server: tankbot\x0d\x0a"
+        "Content-Type: %s\x0d\x0a"
+        "Content-Length: %zu\x0d\x0a"
+        "%s%s%s"
+        "Vary: Accept-Encoding\x0d\x0a"
+        "ETag: \"%016llx\"\x0d\x0a"
+        "Cache-Control: public, max-age=%d\x0d\x0a"
+        "\x0d\x0a",
+        mimetype, length, encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+        encoding ? "\x0d\x0a" : "", (unsigned long long)etag, ASSET_MAX_AGE);
+
+    if (header_length < 0 || (size_t)header_length >= sizeof(header))
+        return NULL;
+
+    unsigned char *response = malloc(header_length + length);
+    if (!response)
+        return NULL;
+
+    memcpy(response, header, header_length);
+    memcpy(response + header_length, body, length);
+    *response_length = header_length + length;
+    return response;
+}
+
+struct asset *asset_load(const char *path, const char *mimetype)
+{
+    size_t length;
+    unsigned char *data = read_file(path, &length);
+    if (!data)
+    {
+        log_error("Failed to read %s\n", path);
+        return NULL;
+    }
+
+    struct asset *asset = calloc(1, sizeof(struct asset));
+    if (!asset)
+    {
+        free(data);
+        return NULL;
+    }
+
+    uint64_t etag = hash(data, length);
+    asset->size = length;
+    asset->response = build_response(mimetype, NULL, etag, data, length, &asset->response_length);
+
+    size_t gzip_length;
+    unsigned char *compressed = compress_gzip(data, length, &gzip_length);
+    if (compressed)
+    {
+        // Different encodings are different representations, so need distinct tags
+        asset->gzip_size = gzip_length;
+        asset->gzip_response = build_response(mimetype, "gzip", etag ^ 1, compressed, gzip_length,
+                                              &asset->gzip_response_length);
+        free(compressed);
+    }
+
+    free(data);
+    if (!asset->response)
+    {
+        asset_free(asset);
+        return NULL;
+    }
+
+    return asset;
+}
+
+void asset_free(struct asset *asset)
+{
+    free(asset->response);
+    free(asset->gzip_response);
+    free(asset);
+}
+
+// The complete response for the asset, compressed if requested and available
+const unsigned char *asset_response(struct asset *asset, bool gzip, size_t *length)
+{
+    if (gzip && asset->gzip_response)
+    {
+        *length = asset->gzip_response_length;
+        return asset->gzip_response;
+    }
+
+    *length = asset->response_length;
+    return asset->response;
+}
+
+// Size of the body served by asset_response
+size_t asset_size(struct asset *asset, bool gzip)
+{
+    return gzip && asset->gzip_response ? asset->gzip_size : asset->size;
+}
@@ -0,0 +1,22 @@
+//*****************************************************************************
+//  Static files served over HTTP, loaded into memory at startup
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_ASSET_H
+#define TANKBOT_ASSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct asset;
+struct asset *asset_load(const char *path, const char *mimetype);
+void asset_free(struct asset *asset);
+const unsigned char *asset_response(struct asset *asset, bool gzip, size_t *length);
+size_t asset_size(struct asset *asset, bool gzip);
+
+#endif
@@ -9,6 +9,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -20,28 +21,203 @@
 #include <unistd.h>
 
 #include "avr.h"
+#include "capture.h"
+#include "decoder.h"
+#include "histogram.h"
+#include "log.h"
+#include "realtime.h"
 #include "serial.h"
-#include "webserver.h"
+#include "timing.h"
+#include "../framing.h"
 #include "../protocol.h"
 
-extern struct webserver *webserver;
+#define AVR_RECEIVE_BUFFER_SIZE 4096
+
+// Speed changes smaller than this are not sent to the avr
+#define AVR_DEFAULT_SPEED_EPSILON 0.005
+
+// Resend the current speed at least this often (ms) while it is unchanged
+#define AVR_DEFAULT_SPEED_KEEPALIVE 500
+
+// Speeds older than this (ms) when they reach the avr are discarded
+#define AVR_DEFAULT_SPEED_MAX_AGE 250
+
+// Relative drift allowed between the avr and server clocks, in parts per
+// million. Ceramic resonators are typically accurate to 0.5%.
+#define AVR_CLOCK_DRIFT_PPM 5000
+
+// Interval between round-trip time measurements, in ms
+#define AVR_DEFAULT_PING_INTERVAL 1000
+
+// Interval between framing change requests until the avr acknowledges, in ms
+#define AVR_FRAMING_RETRY_INTERVAL 1000
+
+// Give up on a framing version if the avr doesn't acknowledge it,
+// e.g. because it is running older firmware
+#define AVR_FRAMING_MAX_ATTEMPTS 3
+
+// Fall back to version 1 framing if no valid frames are received for
+// this many ping intervals (and at least this many ms)
+#define AVR_FRAMING_TIMEOUT_PINGS 3
+#define AVR_FRAMING_TIMEOUT_MIN 3000
+
+// Line rates to negotiate, fastest first. All can be generated exactly
+// by the avr's 16MHz clock in double speed mode.
+static const uint32_t avr_baud_rates[] = { 1000000, 500000, 250000 };
+#define AVR_BAUD_RATE_COUNT (sizeof(avr_baud_rates) / sizeof(avr_baud_rates[0]))
+
+// Time to wait for the avr to reply to a rate proposal or confirmation, in ms
+#define AVR_BAUD_REPLY_TIMEOUT 500
+
+// A new rate is tested with this many pings at this interval (ms)
+#define AVR_BAUD_TEST_PINGS 50
+#define AVR_BAUD_TEST_INTERVAL 10
+
+// Largest fraction of test pings that may be lost or corrupted
+#define AVR_BAUD_MAX_ERROR_RATE 0.02
+
+// After a failed test, wait for the avr to give up on the new rate (ms)
+#define AVR_BAUD_REVERT_DELAY 1500
+
+// The avr returns to the initial rate if it hears nothing for three seconds,
+// so pings are sent at least this often (ms) while using a negotiated rate
+#define AVR_BAUD_KEEPALIVE 1000
+
+enum baud_state
+{
+    BAUD_IDLE,
+    BAUD_PROPOSED,
+    BAUD_ACCEPTED,
+    BAUD_TESTING,
+    BAUD_CONFIRMING,
+    BAUD_REVERTING,
+    BAUD_DONE
+};
+
 struct avr
 {
     pthread_t thread;
     bool thread_alive;
     bool shutdown;
 
+    // Serviced by the caller's poll loop rather than a worker thread
+    bool polled;
+
     char *serial_port;
     uint32_t serial_baud;
+    struct serial_port *port;
+
+    // Frame being written to the port. Only accessed by the worker thread.
+    uint8_t tx_frame[FRAMING_MAX_LENGTH];
+    size_t tx_length;
+    size_t tx_written;
+    uint8_t tx_sequence;
+
+    // Written by the worker thread, read by avr_get_transmit_stats
+    uint64_t tx_bytes;
+    uint64_t tx_frames;
+    uint32_t tx_queued;
+
+    // Framing version negotiation
+    uint8_t framing_requested;
+    uint8_t framing_version;
+    uint64_t framing_sent_time;
+    uint8_t framing_attempts;
+    uint8_t framing_abandoned;
+    uint64_t last_receive_time;
+
+    // Line rate negotiation. baud_current and the results
+    // are also read by avr_get_baud_stats.
+    uint32_t baud_max;
+    uint32_t baud_current;
+    enum baud_state baud_state;
+    uint8_t baud_candidate;
+    uint8_t baud_attempts;
+    uint64_t baud_state_time;
+    uint64_t baud_test_pings;
+    uint64_t baud_test_pongs;
+    uint64_t baud_test_errors;
+    struct avr_baud_result baud_trial;
+    struct avr_baud_result baud_results[AVR_MAX_BAUD_RESULTS];
+    uint8_t baud_result_count;
+
+    // Frames received from the serial port
+    struct decoder *decoder;
 
-    uint8_t send_buffer[256];
-    uint8_t send_length;
-    pthread_mutex_t send_mutex;
+    // Latest speed requested by avr_set_speed, packed as
+    // generation << 32 | (uint16_t)left << 16 | (uint16_t)right.
+    // The generation counts requests from 1, so 0 means no speed yet.
+    uint64_t speed_mailbox;
+    uint32_t speed_generation;
+
+    // Speed send policy
+    int16_t speed_epsilon;
+    uint32_t speed_keepalive_ms;
+
+    // Last speed written to the port. Only accessed by the worker thread.
+    struct packet_speed speed_sent;
+    uint64_t speed_sent_time;
+    bool speed_sent_valid;
+    uint32_t speed_max_age_ms;
+    uint64_t speeds_sent;
+
+    // Mailbox generations that have been sent or suppressed, and
+    // the last one held back. Only accessed by the worker thread.
+    uint32_t speed_handled_generation;
+    uint32_t speed_deferred_generation;
+
+    // Written by the worker thread, read by avr_get_speed_stats
+    uint64_t speeds_overwritten;
+    uint64_t speeds_suppressed;
+    uint64_t speeds_deferred;
+    bool speed_deferring;
+
+    // Copy of speed_sent for other threads, packed as in speed_mailbox
+    uint64_t speed_telemetry;
+
+    // Estimate of the avr clock relative to timing_now_ns, in ms modulo
+    // 2^16, and its uncertainty at clock_sample_time
+    bool clock_synced;
+    uint16_t clock_offset;
+    uint64_t clock_sample_time;
+    uint64_t clock_uncertainty;
+
+    // Expired speed count reported by the avr
+    uint16_t speeds_expired_reported;
+    uint64_t speeds_expired;
+
+    // Set once the first valid packet has been received from the avr
+    bool link_active;
+
+    // Link round-trip time measurement
+    uint32_t ping_interval_ms;
+    uint64_t ping_sent_time;
+    uint16_t ping_sequence;
+    uint64_t pings_sent;
+    uint64_t pongs_received;
+    struct histogram ping_rtt;
+    uint32_t last_rtt_us;
+
+    // Scheduling settings, applied by the worker thread when requested
+    struct realtime_config realtime;
+    bool realtime_requested;
+
+    // How late poll() returns after its timeout expires
+    struct histogram wakeup_latency;
+
+    avr_message_handler message_handler;
+    void *message_context;
+
+    // Records serial traffic, or NULL
+    struct capture *capture;
+
+    // Self-pipe used to wake the worker thread when data is queued
+    int wakeup_pipe[2];
 };
 
 static void *avr_thread(void *avr);
 
-struct avr *avr_new(const char *port, uint32_t baud)
+static struct avr *avr_create(const char *port, uint32_t baud, avr_message_handler handler, void *context)
 {
     struct avr *avr = calloc(1, sizeof(struct avr));
     if (!avr)
@@ -49,236 +225,1068 @@ struct avr *avr_new(const char *port, uint32_t baud)
 
     avr->serial_port = strdup(port);
     avr->serial_baud = baud;
-    pthread_mutex_init(&avr->send_mutex, NULL);
+    avr->message_handler = handler;
+    avr->message_context = context;
+    avr->speed_epsilon = (int16_t)(10000*AVR_DEFAULT_SPEED_EPSILON);
+    avr->speed_keepalive_ms = AVR_DEFAULT_SPEED_KEEPALIVE;
+    avr->speed_max_age_ms = AVR_DEFAULT_SPEED_MAX_AGE;
+    avr->ping_interval_ms = AVR_DEFAULT_PING_INTERVAL;
+    avr->framing_requested = 1;
+    avr->framing_version = 1;
+    avr->baud_max = baud;
+    avr->baud_current = baud;
+    avr->realtime.cpu = -1;
+    avr->wakeup_pipe[0] = avr->wakeup_pipe[1] = -1;
+
+    avr->decoder = decoder_new(AVR_RECEIVE_BUFFER_SIZE);
+    if (!avr->decoder)
+    {
+        free(avr->serial_port);
+        free(avr);
+        return NULL;
+    }
+
+    return avr;
+}
+
+// Create a connection serviced by its own worker thread
+struct avr *avr_new(const char *port, uint32_t baud, avr_message_handler handler, void *context)
+{
+    struct avr *avr = avr_create(port, baud, handler, context);
+    if (!avr)
+        return NULL;
+
+    // Writes must never block the caller, and the worker drains the
+    // read end until empty after each wakeup
+    if (pipe(avr->wakeup_pipe) == -1)
+    {
+        log_error("Failed to create wakeup pipe: %s\n", strerror(errno));
+        avr_free(avr);
+        return NULL;
+    }
+
+    fcntl(avr->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(avr->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
 
     // Spawn the worker thread
     avr->thread_alive = true;
     if (pthread_create(&avr->thread, NULL, avr_thread, avr))
     {
-        printf("Failed to spawn avr communication thread\n");
+        log_error("Failed to spawn avr communication thread\n");
+        avr_free(avr);
+        return NULL;
+    }
+
+    return avr;
+}
+
+// Create a connection serviced from the caller's poll loop, using
+// avr_poll_fd and avr_service, so that no worker thread is needed
+struct avr *avr_new_polled(const char *port, uint32_t baud, avr_message_handler handler, void *context)
+{
+    struct avr *avr = avr_create(port, baud, handler, context);
+    if (!avr)
+        return NULL;
+
+    avr->polled = true;
+    avr->port = serial_port_open(avr->serial_port, avr->serial_baud);
+    if (!avr->port)
+    {
+        log_error("Failed to open serial port\n");
         avr_free(avr);
         return NULL;
     }
 
+    avr->thread_alive = true;
     return avr;
 }
 
 void avr_free(struct avr *avr)
 {
-    pthread_mutex_destroy(&avr->send_mutex);
+    if (avr->polled && avr->port)
+        serial_port_close(avr->port);
+    if (avr->wakeup_pipe[0] >= 0)
+        close(avr->wakeup_pipe[0]);
+    if (avr->wakeup_pipe[1] >= 0)
+        close(avr->wakeup_pipe[1]);
+    decoder_free(avr->decoder);
     free(avr->serial_port);
     free(avr);
 }
 
-// Queue a raw byte to be sent to the avr
-// Should only be called by queue_data
-static void queue_send_byte(struct avr *avr, uint8_t b)
+// Wake the worker thread from its poll()
+// A full pipe already guarantees a pending wakeup, so errors are ignored
+static void wakeup_thread(struct avr *avr)
 {
-    // Hard-loop until the send buffer empties
-    // Should never happen in normal operation
-    // TODO: This should use a signal or return an error code
-    while (avr->send_length >= 255);
+    // The caller's loop services the port before it next polls
+    if (avr->polled)
+        return;
+
+    uint8_t b = 0;
+    ssize_t ret = write(avr->wakeup_pipe[1], &b, 1);
+    (void)ret;
+}
 
-    pthread_mutex_lock(&avr->send_mutex);
-    avr->send_buffer[avr->send_length++] = b;
-    pthread_mutex_unlock(&avr->send_mutex);
+// Clear pending wakeups so the next poll() blocks
+static void drain_wakeups(struct avr *avr)
+{
+    uint8_t discard[64];
+    while (read(avr->wakeup_pipe[0], discard, sizeof(discard)) > 0);
 }
 
-// Wrap an array of bytes in a data packet and send it to the timer
-static void queue_data(struct avr *avr, enum packet_type type, void *_data, size_t length)
+// Switch both directions to a new framing version
+static void set_framing(struct avr *avr, uint8_t version)
 {
-    uint8_t *data = _data;
+    decoder_set_version(avr->decoder, version);
+    avr->tx_sequence = 0;
+    avr->last_receive_time = timing_now_ns();
+    __atomic_store_n(&avr->framing_version, version, __ATOMIC_RELAXED);
+}
 
-    // Header
-    queue_send_byte(avr, '$');
-    queue_send_byte(avr, '$');
-    queue_send_byte(avr, type);
-    queue_send_byte(avr, length);
+// Frame a packet using the active framing version.
+// The previous frame must have been completely written.
+static void frame_packet(struct avr *avr, enum packet_type type, const void *data, uint8_t length)
+{
+    if (avr->framing_version == 2)
+        avr->tx_length = framing_encode_v2(avr->tx_frame, type, avr->tx_sequence++, data, length);
+    else
+        avr->tx_length = framing_encode_v1(avr->tx_frame, type, data, length);
+    avr->tx_written = 0;
+    __atomic_store_n(&avr->tx_frames, avr->tx_frames + 1, __ATOMIC_RELAXED);
+}
 
-    // Data
-    uint8_t checksum = 0;
-    for (uint8_t i = 0; i < length; i++)
+// Continue writing the current frame
+// Returns the number of bytes still to be written, or a negative error
+static ssize_t flush_frame(struct avr *avr, struct serial_port *port)
+{
+    while (avr->tx_written < avr->tx_length)
     {
-        checksum ^= data[i];
-        queue_send_byte(avr, data[i]);
+        ssize_t ret = serial_port_write(port, &avr->tx_frame[avr->tx_written], avr->tx_length - avr->tx_written);
+        if (ret < 0)
+            return ret;
+
+        // Port buffer is full: wait for POLLOUT before trying again
+        if (ret == 0)
+            break;
+
+        log_debug("Sent %zd bytes\n", ret);
+        struct capture *capture = __atomic_load_n(&avr->capture, __ATOMIC_ACQUIRE);
+        if (capture)
+            capture_write(capture, CAPTURE_SERIAL_SEND, 0, 0, &avr->tx_frame[avr->tx_written], ret);
+
+        avr->tx_written += ret;
+        __atomic_store_n(&avr->tx_bytes, avr->tx_bytes + ret, __ATOMIC_RELAXED);
     }
 
-    // Footer
-    queue_send_byte(avr, checksum);
-    queue_send_byte(avr, '\r');
-    queue_send_byte(avr, '\n');
+    return avr->tx_length - avr->tx_written;
+}
+
+// True while the avr may not be able to receive packets
+static bool send_blocked(struct avr *avr)
+{
+    return avr->framing_sent_time || avr->baud_state == BAUD_PROPOSED ||
+           avr->baud_state == BAUD_ACCEPTED || avr->baud_state == BAUD_REVERTING;
+}
+
+// True if a frame is still being written
+static bool send_busy(struct avr *avr)
+{
+    return avr->tx_written < avr->tx_length;
+}
+
+// Shorten a poll() timeout so that it expires within the given interval
+static void limit_timeout(int *timeout_ms, uint64_t interval_ns)
+{
+    int ms = (int)((interval_ns + 999999) / 1000000);
+    if (*timeout_ms < 0 || ms < *timeout_ms)
+        *timeout_ms = ms;
+}
+
+// Uncertainty of the avr clock estimate, growing with drift since the last sample
+static uint64_t clock_uncertainty(struct avr *avr, uint64_t now)
+{
+    return avr->clock_uncertainty + (now - avr->clock_sample_time) / 1000000 * AVR_CLOCK_DRIFT_PPM;
+}
+
+// Avr clock time after which a speed sent now should be ignored
+static uint16_t speed_deadline(struct avr *avr, uint64_t now)
+{
+    uint64_t max_age = __atomic_load_n(&avr->speed_max_age_ms, __ATOMIC_RELAXED) * 1000000ULL;
+    if (!max_age || !avr->clock_synced)
+        return SPEED_NO_DEADLINE;
+
+    // Give the benefit of the doubt to packets when the clocks may disagree,
+    // and don't set deadlines that the 16 bit avr clock can't represent
+    uint64_t margin = max_age + clock_uncertainty(avr, now);
+    if (margin > 30000000000ULL)
+        return SPEED_NO_DEADLINE;
+
+    uint16_t deadline = (uint16_t)((now + margin) / 1000000) + avr->clock_offset;
+    return deadline == SPEED_NO_DEADLINE ? deadline - 1 : deadline;
 }
 
-static void parse_packet(struct avr *avr, enum packet_type type, union packet_data data, uint8_t length)
+// Send the newest requested speed if it differs enough from the last one sent,
+// or if the keepalive interval has expired
+static ssize_t send_speed(struct avr *avr, struct serial_port *port, int *timeout_ms)
 {
-    switch (type)
+    uint64_t mailbox = __atomic_load_n(&avr->speed_mailbox, __ATOMIC_ACQUIRE);
+    uint32_t generation = mailbox >> 32;
+    if (!generation || send_blocked(avr))
+        return 0;
+
+    struct packet_speed speed = {
+        .left = (int16_t)(mailbox >> 16),
+        .right = (int16_t)mailbox
+    };
+
+    uint64_t now = timing_now_ns();
+    int16_t epsilon = __atomic_load_n(&avr->speed_epsilon, __ATOMIC_RELAXED);
+    uint64_t keepalive = __atomic_load_n(&avr->speed_keepalive_ms, __ATOMIC_RELAXED) * 1000000ULL;
+    bool send = !avr->speed_sent_valid;
+    if (!send)
     {
-    case MESSAGE:
+        int dl = abs(speed.left - avr->speed_sent.left);
+        int dr = abs(speed.right - avr->speed_sent.right);
+
+        // Always pass on a stop, however small the change
+        bool stop = speed.left == 0 && speed.right == 0;
+        send = (dl || dr) && (stop || dl >= epsilon || dr >= epsilon);
+
+        if (keepalive && now - avr->speed_sent_time >= keepalive)
+            send = true;
+    }
+
+    if (send)
+    {
+        // Hold back while earlier data is still in flight so that
+        // the setpoint is chosen at the last possible moment
+        bool deferring = send_busy(avr) || serial_port_output_pending(port) > 0;
+        if (deferring != avr->speed_deferring)
+            __atomic_store_n(&avr->speed_deferring, deferring, __ATOMIC_RELAXED);
+
+        if (deferring)
+        {
+            if (generation != avr->speed_deferred_generation)
+            {
+                avr->speed_deferred_generation = generation;
+                __atomic_store_n(&avr->speeds_deferred, avr->speeds_deferred + 1, __ATOMIC_RELAXED);
+            }
+
+            limit_timeout(timeout_ms, 1000000);
+            return 0;
+        }
+
+        speed.deadline = speed_deadline(avr, now);
+        log_debug("Sending speed packet: %d %d\n", speed.left, speed.right);
+        frame_packet(avr, SPEED, &speed, sizeof(struct packet_speed));
+        ssize_t ret = flush_frame(avr, port);
+        if (ret < 0)
+            return ret;
+
+        avr->speed_sent = speed;
+        avr->speed_sent_time = now;
+        avr->speed_sent_valid = true;
+        __atomic_add_fetch(&avr->speeds_sent, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&avr->speed_telemetry, mailbox, __ATOMIC_RELAXED);
+    }
+    else if (generation != avr->speed_handled_generation)
+        __atomic_store_n(&avr->speeds_suppressed, avr->speeds_suppressed + 1, __ATOMIC_RELAXED);
+
+    // Requests replaced in the mailbox before they could be sent or suppressed
+    if (generation != avr->speed_handled_generation)
+    {
+        uint32_t skipped = generation - avr->speed_handled_generation - 1;
+        if (skipped)
+            __atomic_store_n(&avr->speeds_overwritten, avr->speeds_overwritten + skipped, __ATOMIC_RELAXED);
+        avr->speed_handled_generation = generation;
+    }
+
+    if (keepalive)
+        limit_timeout(timeout_ms, avr->speed_sent_time + keepalive - now);
+
+    return 0;
+}
+
+// Interval between pings in ms, taking into account their
+// use as a keepalive and for testing new line rates
+static uint64_t ping_interval(struct avr *avr)
+{
+    uint64_t interval = __atomic_load_n(&avr->ping_interval_ms, __ATOMIC_RELAXED);
+    if (avr->baud_state == BAUD_TESTING)
+        return AVR_BAUD_TEST_INTERVAL;
+
+    if (avr->baud_current != avr->serial_baud && (!interval || interval > AVR_BAUD_KEEPALIVE))
+        return AVR_BAUD_KEEPALIVE;
+
+    return interval;
+}
+
+// Send a ping packet if one is due
+static ssize_t send_ping(struct avr *avr, struct serial_port *port, int *timeout_ms)
+{
+    uint64_t interval = ping_interval(avr) * 1000000ULL;
+
+    // Pings sent before the avr has finished starting up
+    // would measure the startup time, not the link
+    if (!interval || !avr->link_active || send_blocked(avr))
+        return 0;
+
+    // Line rate tests use a fixed number of pings
+    if (avr->baud_state == BAUD_TESTING && avr->pings_sent - avr->baud_test_pings >= AVR_BAUD_TEST_PINGS)
+        return 0;
+
+    uint64_t now = timing_now_ns();
+    if (avr->ping_sent_time && now - avr->ping_sent_time < interval)
+    {
+        limit_timeout(timeout_ms, avr->ping_sent_time + interval - now);
+        return 0;
+    }
+
+    // Wait for any partially written frame to complete
+    if (send_busy(avr))
+    {
+        limit_timeout(timeout_ms, 1000000);
+        return 0;
+    }
+
+    struct packet_ping ping = {
+        .timestamp = (uint32_t)(now / 1000),
+        .sequence = ++avr->ping_sequence
+    };
+
+    frame_packet(avr, PING, &ping, sizeof(struct packet_ping));
+    ssize_t ret = flush_frame(avr, port);
+    if (ret < 0)
+        return ret;
+
+    avr->ping_sent_time = now;
+    __atomic_add_fetch(&avr->pings_sent, 1, __ATOMIC_RELAXED);
+    limit_timeout(timeout_ms, interval);
+    return 0;
+}
+
+// Ask the avr to switch to the requested framing version, retrying until
+// it acknowledges. Other packets are held back until the switch completes.
+static ssize_t send_framing(struct avr *avr, struct serial_port *port, int *timeout_ms)
+{
+    uint8_t requested = __atomic_load_n(&avr->framing_requested, __ATOMIC_RELAXED);
+    if (!avr->link_active || requested == avr->framing_abandoned ||
+        (requested == avr->framing_version && !avr->framing_sent_time))
+        return 0;
+
+    uint64_t now = timing_now_ns();
+    uint64_t retry = AVR_FRAMING_RETRY_INTERVAL * 1000000ULL;
+    if (avr->framing_sent_time && now - avr->framing_sent_time < retry)
+    {
+        limit_timeout(timeout_ms, avr->framing_sent_time + retry - now);
+        return 0;
+    }
+
+    if (avr->framing_attempts == AVR_FRAMING_MAX_ATTEMPTS)
+    {
+        log_warning("AVR did not acknowledge framing version %u; using version %u\n",
+                    requested, avr->framing_version);
+        avr->framing_abandoned = requested;
+        avr->framing_attempts = 0;
+        avr->framing_sent_time = 0;
+        return 0;
+    }
+
+    if (avr->tx_written < avr->tx_length)
+    {
+        limit_timeout(timeout_ms, 1000000);
+        return 0;
+    }
+
+    // The request and reply always use version 1 framing,
+    // which also resynchronizes an avr that has lost track
+    set_framing(avr, 1);
+
+    log_info("Requesting framing version %u\n", requested);
+    struct packet_framing framing = { .version = requested };
+    frame_packet(avr, FRAMING, &framing, sizeof(struct packet_framing));
+    ssize_t ret = flush_frame(avr, port);
+    if (ret < 0)
+        return ret;
+
+    avr->framing_sent_time = now;
+    avr->framing_attempts++;
+    limit_timeout(timeout_ms, retry);
+    return 0;
+}
+
+static void parse_framing(struct avr *avr, const struct decoder_frame *frame)
+{
+    if (frame->length != sizeof(struct packet_framing))
+    {
+        log_warning("Invalid framing packet length: %u\n", frame->length);
+        return;
+    }
+
+    const struct packet_framing *framing = (const struct packet_framing *)frame->data;
+    if (framing->version != 1 && framing->version != 2)
+    {
+        log_warning("Invalid framing version: %u\n", framing->version);
+        return;
+    }
+
+    log_info("Using framing version %u\n", framing->version);
+    set_framing(avr, framing->version);
+    avr->framing_sent_time = 0;
+    avr->framing_attempts = 0;
+}
+
+// Return to version 1 framing and the initial line rate if the link has
+// gone quiet, e.g. because the avr has been reset. Pings guarantee regular
+// traffic, so this is disabled along with them.
+static ssize_t check_link_timeout(struct avr *avr, struct serial_port *port, int *timeout_ms)
+{
+    uint64_t interval = ping_interval(avr);
+    bool negotiated = avr->framing_version != 1 || avr->baud_current != avr->serial_baud;
+    if (!negotiated || !interval)
+        return 0;
+
+    uint64_t limit = interval * AVR_FRAMING_TIMEOUT_PINGS;
+    if (limit < AVR_FRAMING_TIMEOUT_MIN)
+        limit = AVR_FRAMING_TIMEOUT_MIN;
+    limit *= 1000000ULL;
+
+    uint64_t now = timing_now_ns();
+    if (now - avr->last_receive_time < limit)
+    {
+        limit_timeout(timeout_ms, avr->last_receive_time + limit - now);
+        return 0;
+    }
+
+    log_warning("No valid frames received for %llu ms; reverting to framing version 1 at %u baud\n",
+                (unsigned long long)((now - avr->last_receive_time) / 1000000), avr->serial_baud);
+    set_framing(avr, 1);
+
+    // The avr may have been reset
+    avr->clock_synced = false;
+
+    if (avr->baud_current != avr->serial_baud)
+    {
+        if (serial_port_set_baud(port, avr->serial_baud))
+            return -EIO;
+
+        __atomic_store_n(&avr->baud_current, avr->serial_baud, __ATOMIC_RELAXED);
+        avr->baud_state = BAUD_IDLE;
+        avr->baud_candidate = 0;
+    }
+
+    return 0;
+}
+
+// Sum of decoder failures, used to measure the error rate at a new line rate
+static uint64_t receive_errors(struct avr *avr)
+{
+    struct decoder_stats stats;
+    decoder_get_stats(avr->decoder, &stats);
+    return stats.long_packets + stats.checksum_failures + stats.footer_failures + stats.crc_failures;
+}
+
+static void record_baud_result(struct avr *avr)
+{
+    uint8_t count = avr->baud_result_count;
+    if (count == AVR_MAX_BAUD_RESULTS)
+        return;
+
+    avr->baud_results[count] = avr->baud_trial;
+    __atomic_store_n(&avr->baud_result_count, count + 1, __ATOMIC_RELEASE);
+}
+
+static ssize_t send_baud(struct avr *avr, struct serial_port *port, enum baud_stage stage)
+{
+    struct packet_baud baud = { .rate = avr->baud_trial.rate, .stage = stage };
+    frame_packet(avr, BAUD, &baud, sizeof(struct packet_baud));
+    ssize_t ret = flush_frame(avr, port);
+    avr->baud_state_time = timing_now_ns();
+    return ret < 0 ? ret : 0;
+}
+
+// Propose the next untried rate that is faster than the current one
+static ssize_t propose_baud(struct avr *avr, struct serial_port *port, int *timeout_ms)
+{
+    uint32_t max = __atomic_load_n(&avr->baud_max, __ATOMIC_RELAXED);
+    while (avr->baud_candidate < AVR_BAUD_RATE_COUNT &&
+           (avr_baud_rates[avr->baud_candidate] > max ||
+            avr_baud_rates[avr->baud_candidate] <= avr->baud_current))
+        avr->baud_candidate++;
+
+    if (avr->baud_candidate == AVR_BAUD_RATE_COUNT)
+    {
+        if (avr->baud_result_count > 0)
+            log_info("Link running at %u baud\n", avr->baud_current);
+        avr->baud_state = BAUD_DONE;
+        return 0;
+    }
+
+    // The avr switches rate as soon as it has replied,
+    // so nothing else may be in flight
+    if (avr->tx_written < avr->tx_length)
+    {
+        limit_timeout(timeout_ms, 1000000);
+        return 0;
+    }
+
+    memset(&avr->baud_trial, 0, sizeof(struct avr_baud_result));
+    avr->baud_trial.rate = avr_baud_rates[avr->baud_candidate];
+    avr->baud_state = BAUD_PROPOSED;
+    log_info("Proposing %u baud\n", avr->baud_trial.rate);
+
+    limit_timeout(timeout_ms, AVR_BAUD_REPLY_TIMEOUT * 1000000ULL);
+    return send_baud(avr, port, BAUD_PROPOSE);
+}
+
+// Give up on the trial rate and return to the current rate
+static ssize_t revert_baud(struct avr *avr, struct serial_port *port, int *timeout_ms)
+{
+    record_baud_result(avr);
+    avr->baud_candidate++;
+
+    if (serial_port_drain(port) || serial_port_set_baud(port, avr->baud_current))
+        return -EIO;
+
+    serial_port_flush_input(port);
+    avr->baud_state = BAUD_REVERTING;
+    avr->baud_state_time = timing_now_ns();
+    limit_timeout(timeout_ms, AVR_BAUD_REVERT_DELAY * 1000000ULL);
+    return 0;
+}
+
+// Step the line rate negotiation
+static ssize_t negotiate_baud(struct avr *avr, struct serial_port *port, int *timeout_ms)
+{
+    uint64_t now = timing_now_ns();
+    uint64_t elapsed = now - avr->baud_state_time;
+    uint64_t reply_timeout = AVR_BAUD_REPLY_TIMEOUT * 1000000ULL;
+
+    switch (avr->baud_state)
+    {
+    case BAUD_IDLE:
+        // Framing is settled first so that the test uses it
+        if (!avr->link_active || avr->framing_sent_time)
+            return 0;
+        return propose_baud(avr, port, timeout_ms);
+
+    case BAUD_PROPOSED:
+        if (elapsed < reply_timeout)
+        {
+            limit_timeout(timeout_ms, reply_timeout - elapsed);
+            return 0;
+        }
+
+        // Firmware that predates negotiation never replies
+        if (++avr->baud_attempts < 3)
+            return send_baud(avr, port, BAUD_PROPOSE);
+
+        log_warning("AVR did not reply to baud rate proposal; staying at %u baud\n", avr->baud_current);
+        avr->baud_state = BAUD_DONE;
+        return 0;
+
+    case BAUD_ACCEPTED:
+        // Wait for our side of the link to go idle before switching
+        if (serial_port_drain(port) || serial_port_set_baud(port, avr->baud_trial.rate))
+            return revert_baud(avr, port, timeout_ms);
+
+        serial_port_flush_input(port);
+        avr->baud_test_pings = __atomic_load_n(&avr->pings_sent, __ATOMIC_RELAXED);
+        avr->baud_test_pongs = __atomic_load_n(&avr->pongs_received, __ATOMIC_RELAXED);
+        avr->baud_test_errors = receive_errors(avr);
+        avr->ping_sent_time = 0;
+        avr->baud_state = BAUD_TESTING;
+        avr->baud_state_time = now;
+        return 0;
+
+    case BAUD_TESTING:
+        {
+            uint64_t pings = __atomic_load_n(&avr->pings_sent, __ATOMIC_RELAXED) - avr->baud_test_pings;
+            uint64_t pongs = __atomic_load_n(&avr->pongs_received, __ATOMIC_RELAXED) - avr->baud_test_pongs;
+            if (pings < AVR_BAUD_TEST_PINGS)
+                return 0;
+
+            // Give the last pongs time to arrive
+            if (pongs < pings && now - avr->ping_sent_time < reply_timeout)
+            {
+                limit_timeout(timeout_ms, avr->ping_sent_time + reply_timeout - now);
+                return 0;
+            }
+
+            struct avr_baud_result *trial = &avr->baud_trial;
+            trial->pings = pings;
+            trial->pongs = pongs;
+            trial->errors = receive_errors(avr) - avr->baud_test_errors;
+
+            double error_rate = (double)(pings - pongs + trial->errors) / pings;
+            log_info("Tested %u baud: %u of %u pings returned, %u frame errors (%.1f%% error rate)\n",
+                     trial->rate, trial->pongs, trial->pings, trial->errors, 100 * error_rate);
+
+            if (error_rate > AVR_BAUD_MAX_ERROR_RATE)
+                return revert_baud(avr, port, timeout_ms);
+
+            avr->baud_state = BAUD_CONFIRMING;
+            limit_timeout(timeout_ms, reply_timeout);
+            return send_baud(avr, port, BAUD_CONFIRM);
+        }
+
+    case BAUD_CONFIRMING:
+        if (elapsed < reply_timeout)
+        {
+            limit_timeout(timeout_ms, reply_timeout - elapsed);
+            return 0;
+        }
+
+        log_warning("AVR did not confirm %u baud\n", avr->baud_trial.rate);
+        return revert_baud(avr, port, timeout_ms);
+
+    case BAUD_REVERTING:
+        if (elapsed < AVR_BAUD_REVERT_DELAY * 1000000ULL)
+        {
+            limit_timeout(timeout_ms, AVR_BAUD_REVERT_DELAY * 1000000ULL - elapsed);
+            return 0;
+        }
+
+        avr->baud_state = BAUD_IDLE;
+        return 0;
+
+    case BAUD_DONE:
+        break;
+    }
+
+    return 0;
+}
+
+static void parse_baud(struct avr *avr, const struct decoder_frame *frame)
+{
+    if (frame->length != sizeof(struct packet_baud))
+    {
+        log_warning("Invalid baud packet length: %u\n", frame->length);
+        return;
+    }
+
+    const struct packet_baud *baud = (const struct packet_baud *)frame->data;
+    if (baud->rate != avr->baud_trial.rate)
+    {
+        log_warning("Ignoring reply for %u baud\n", baud->rate);
+        return;
+    }
+
+    if (avr->baud_state == BAUD_PROPOSED && baud->stage == BAUD_ACCEPT)
+    {
+        avr->baud_trial.accepted = true;
+        avr->baud_state = BAUD_ACCEPTED;
+    }
+    else if (avr->baud_state == BAUD_PROPOSED && baud->stage == BAUD_REJECT)
+    {
+        log_info("AVR rejected %u baud\n", baud->rate);
+        record_baud_result(avr);
+        avr->baud_candidate++;
+        avr->baud_state = BAUD_IDLE;
+    }
+    else if (avr->baud_state == BAUD_CONFIRMING && baud->stage == BAUD_CONFIRM)
+    {
+        avr->baud_trial.selected = true;
+        record_baud_result(avr);
+        __atomic_store_n(&avr->baud_current, baud->rate, __ATOMIC_RELAXED);
+        log_info("Link running at %u baud\n", baud->rate);
+        avr->baud_state = BAUD_DONE;
+    }
+}
+
+static void parse_pong(struct avr *avr, const struct decoder_frame *frame)
+{
+    if (frame->length != sizeof(struct packet_pong))
+    {
+        log_warning("Invalid pong packet length: %u\n", frame->length);
+        return;
+    }
+
+    // The timestamp wraps every 71 minutes, which unsigned arithmetic handles
+    const struct packet_pong *pong = (const struct packet_pong *)frame->data;
+    uint64_t now = timing_now_ns();
+    uint32_t rtt_us = (uint32_t)(now / 1000) - pong->timestamp;
+
+    histogram_record(&avr->ping_rtt, rtt_us * 1000ULL);
+    __atomic_store_n(&avr->last_rtt_us, rtt_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&avr->pongs_received, 1, __ATOMIC_RELAXED);
+
+    if (avr->clock_synced)
+    {
+        uint16_t expired = pong->speeds_expired - avr->speeds_expired_reported;
+        if (expired)
         {
-            printf("AVR Message: ");
-            for (uint8_t i = 0; i < length; i++)
-                putchar(data.debug.message[i]);
+            log_warning("%u speed packets reached the avr after their deadline\n", expired);
+            __atomic_add_fetch(&avr->speeds_expired, expired, __ATOMIC_RELAXED);
+        }
+    }
+    avr->speeds_expired_reported = pong->speeds_expired;
+
+    // The avr read its clock somewhere within the round trip, so assume the
+    // midpoint. Keep the old estimate unless this one is more certain.
+    uint64_t uncertainty = rtt_us * 500ULL + 1000000;
+    if (!avr->clock_synced || uncertainty <= clock_uncertainty(avr, now))
+    {
+        uint64_t midpoint = now - rtt_us * 500ULL;
+        avr->clock_offset = pong->clock - (uint16_t)(midpoint / 1000000);
+        avr->clock_sample_time = now;
+        avr->clock_uncertainty = uncertainty;
+        avr->clock_synced = true;
+    }
+}
 
-            // TODO: Relying on an extern global isn't great.
-            //webserver_send_debug(webserver, data.debug.message, length);
-            printf("\n");
+static void parse_packet(struct avr *avr, const struct decoder_frame *frame)
+{
+    switch (frame->type)
+    {
+    case PONG:
+        parse_pong(avr, frame);
+        break;
+    case FRAMING:
+        parse_framing(avr, frame);
+        break;
+    case BAUD:
+        parse_baud(avr, frame);
+        break;
+    case MESSAGE:
+        {
+            const char *message = (const char *)frame->data;
+            log_info("AVR Message: %.*s\n", frame->length, message);
+            if (avr->message_handler)
+                avr->message_handler(avr->message_context, message, frame->length);
         }
         break;
     default:
-        printf("Unknown packet type: %c\n", type);
+        log_warning("Unknown packet type: %c\n", frame->type);
     }
 }
 
+// Finish writing the current frame and send any packets that are due, then read and parse everything
+// available. Sets timeout_ms to the longest time until the next call.
+// Returns false if the link has failed.
+static bool service_port(struct avr *avr, int *timeout_ms)
+{
+    struct serial_port *port = avr->port;
+
+    if (__atomic_exchange_n(&avr->realtime_requested, false, __ATOMIC_ACQUIRE))
+        realtime_configure_thread(&avr->realtime);
+
+    ssize_t ret = flush_frame(avr, port);
+    *timeout_ms = -1;
+    if (ret >= 0)
+        ret = send_framing(avr, port, timeout_ms);
+    if (ret >= 0)
+        ret = negotiate_baud(avr, port, timeout_ms);
+    if (ret >= 0)
+        ret = send_speed(avr, port, timeout_ms);
+    if (ret >= 0)
+        ret = send_ping(avr, port, timeout_ms);
+
+    if (ret < 0)
+    {
+        log_error("Write error %zd: %s\n", ret, serial_port_error_string(port, ret));
+        return false;
+    }
+
+    // Read everything available in as few syscalls as possible,
+    // then decode all complete frames in place
+    ssize_t r;
+    size_t space;
+    do
+    {
+        uint8_t *buf = decoder_write_buffer(avr->decoder, &space);
+        r = serial_port_read(port, buf, space);
+        if (r <= 0)
+            break;
+
+        struct capture *capture = __atomic_load_n(&avr->capture, __ATOMIC_ACQUIRE);
+        if (capture)
+            capture_write(capture, CAPTURE_SERIAL_RECEIVE, 0, 0, buf, r);
+
+        decoder_commit(avr->decoder, r);
+
+        struct decoder_frame frame;
+        while (decoder_next(avr->decoder, &frame))
+        {
+            avr->link_active = true;
+            avr->last_receive_time = timing_now_ns();
+            parse_packet(avr, &frame);
+        }
+    } while ((size_t)r == space);
+
+    if (r < 0)
+    {
+        log_error("Read error %zd: %s\n", r, serial_port_error_string(port, r));
+        return false;
+    }
+
+    if (check_link_timeout(avr, port, timeout_ms) < 0)
+    {
+        log_error("Failed to reset baud rate\n");
+        return false;
+    }
+
+    // Bytes not yet written to the port, and bytes waiting in its output queue
+    ssize_t pending = serial_port_output_pending(port);
+    uint32_t queued = avr->tx_length - avr->tx_written + (pending > 0 ? pending : 0);
+    __atomic_store_n(&avr->tx_queued, queued, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// Wait for the avr to send data, or for the port to accept
+// the rest of a partial write
+static short poll_events(struct avr *avr)
+{
+    return avr->tx_written < avr->tx_length ? POLLIN | POLLOUT : POLLIN;
+}
+
+static bool check_poll_result(short revents)
+{
+    if (revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+        log_error("Serial port closed unexpectedly\n");
+        return false;
+    }
+
+    return true;
+}
+
 // Main timer thread loop
 static void *avr_thread(void *_avr)
 {
     struct avr *avr = (struct avr *)_avr;
 
     // Attempt to open the serial connection
-    struct serial_port *port = serial_port_open(avr->serial_port, avr->serial_baud);
-    if (!port)
+    avr->port = serial_port_open(avr->serial_port, avr->serial_baud);
+    if (!avr->port)
     {
-        printf("Failed to open serial port\n");
+        log_error("Failed to open serial port\n");
         goto error;
     }
 
-    // Parsing state
-    uint8_t state = 0;
-    enum packet_type type = 0;
-    uint8_t checksum = 0;
-    uint8_t length = 0;
-    uint8_t read = 0;
-    static union packet_data data;
+    struct pollfd fds[2] = {
+        { .fd = serial_port_fd(avr->port), .events = POLLIN },
+        { .fd = avr->wakeup_pipe[0], .events = POLLIN }
+    };
 
     // Loop until shutdown, parsing incoming data
     while (!avr->shutdown)
     {
-        // Send any queued data
-        pthread_mutex_lock(&avr->send_mutex);
-        if (avr->send_length > 0)
-        {
-            ssize_t ret = serial_port_write(port, avr->send_buffer, avr->send_length);
-            if (ret < 0)
-            {
-                printf("Write error %zd: %s", ret, serial_port_error_string(port, ret));
-                pthread_mutex_unlock(&avr->send_mutex);
-                break;
-            }
+        int timeout_ms;
+        if (!service_port(avr, &timeout_ms))
+            break;
 
-            if (ret != avr->send_length)
-            {
-                printf("Incomplete write: only %zu of %u bytes sent\n", ret, avr->send_length);                
-                pthread_mutex_unlock(&avr->send_mutex);
-                break;
-            }
+        // Block until the avr sends data, new data is queued, the port
+        // can accept the rest of a partial write, or a speed or ping is due
+        fds[0].events = poll_events(avr);
 
-            printf("Sent %zd bytes\n", ret);
-            avr->send_length = 0;
+        uint64_t poll_start = timing_now_ns();
+        int n = poll(fds, 2, timeout_ms);
+        if (n == -1 && errno != EINTR)
+        {
+            log_error("Poll error: %s\n", strerror(errno));
+            break;
         }
-        pthread_mutex_unlock(&avr->send_mutex);
 
-        // Check for new data
-        uint8_t b;
-        ssize_t r;
-        while ((r = serial_port_read(port, &b, 1)) > 0)
+        // A timeout that fires late delays every speed and ping behind it
+        if (n == 0 && timeout_ms >= 0)
         {
-            switch (state)
-            {
-            case 0: // Synchronize to packet header
-            case 1:
-                if (b == '$')
-                    state++;
-                else
-                    state = 0;
-                break;
-            case 2: // Packet type
-                type = b;
-                state++;
-                break;
-            case 3: // Message length
-                length = b;
-                read = 0;
-                checksum = 0;
-                if (length <= sizeof(data))
-                    state++;
-                else
-                {
-                    printf("Ignoring long packet: %c (length %u)\n", type, length);
-                    state = 0;
-                }
-                break;
-            case 4: // Message data
-                checksum ^= b;
-                data.bytes[read++] = b;
-                if (read == length)
-                    state++;
-                break;
-            case 5: // checksum byte
-                if (checksum == b)
-                    state++;
-                else
-                {
-                    printf("Packet checksum failed. Got 0x%02x, expected 0x%02x.\n", b, checksum);
-                    state = 0;
-                }
-                break;
-            case 6: // Packet Footer
-                if (b == '\r')
-                    state++;
-                else
-                {
-                    printf("Invalid packet end byte. Got 0x%02x, expected 0x%02x.\n", b, '\r');
-                    state = 0;
-                }
-                break;
-            case 7:
-                if (b == '\n')
-                    parse_packet(avr, type, data, length);
-                else
-                    printf("Invalid packet end byte. Got 0x%02x, expected 0x%02x.\n", b, '\n');
-
-                state = 0;
-                break;
-            }
+            uint64_t elapsed = timing_now_ns() - poll_start;
+            uint64_t expected = timeout_ms * 1000000ULL;
+            histogram_record(&avr->wakeup_latency, elapsed > expected ? elapsed - expected : 0);
         }
 
-        if (r < 0)
-        {
-            printf("Read error %zd: %s\n", r, serial_port_error_string(port, r));
+        if (!check_poll_result(fds[0].revents))
             break;
-        }
 
-        // Sleep for 100ms
-        nanosleep(&(struct timespec){0, 1e8}, NULL);
+        if (fds[1].revents & POLLIN)
+            drain_wakeups(avr);
     }
 
 error:
-    if (port)
-        serial_port_close(port);
+    if (avr->port)
+        serial_port_close(avr->port);
+    avr->port = NULL;
     avr->thread_alive = false;
     return NULL;
 }
 
+// Serial port descriptor and the events to poll it for,
+// for connections created by avr_new_polled
+int avr_poll_fd(struct avr *avr, short *events)
+{
+    *events = poll_events(avr);
+    return serial_port_fd(avr->port);
+}
+
+// Service a connection created by avr_new_polled, after polling its
+// descriptor. Sets timeout_ms to the longest time until the next call.
+// Returns false, closing the port, if the link has failed.
+bool avr_service(struct avr *avr, short revents, int *timeout_ms)
+{
+    if (!avr->thread_alive)
+        return false;
+
+    if (!check_poll_result(revents) || !service_port(avr, timeout_ms))
+    {
+        serial_port_close(avr->port);
+        avr->port = NULL;
+        avr->thread_alive = false;
+        return false;
+    }
+
+    return true;
+}
+
 void avr_shutdown(struct avr *avr)
 {
+    if (avr->polled)
+    {
+        if (avr->port)
+            serial_port_close(avr->port);
+        avr->port = NULL;
+        avr->thread_alive = false;
+        return;
+    }
+
     avr->shutdown = true;
+    wakeup_thread(avr);
     void **retval = NULL;
     if (avr->thread_alive)
         pthread_join(avr->thread, retval);
 }
 
+// Whether the worker thread is running, or for avr_new_polled,
+// whether the port is still open
 bool avr_thread_alive(struct avr *avr)
 {
     return avr->thread_alive;
 }
 
+// Replace the speed setpoint. Only the newest setpoint is sent to the avr.
 void avr_set_speed(struct avr *avr, double left, double right)
 {
-    struct packet_speed speed = {
-        .left = (int16_t)(10000*left),
-        .right = (int16_t)(10000*right)
-    };
+    uint16_t l = (uint16_t)(int16_t)(10000*left);
+    uint16_t r = (uint16_t)(int16_t)(10000*right);
+    uint32_t generation = __atomic_add_fetch(&avr->speed_generation, 1, __ATOMIC_RELAXED);
+    if (!generation)
+        generation = __atomic_add_fetch(&avr->speed_generation, 1, __ATOMIC_RELAXED);
+
+    uint64_t mailbox = ((uint64_t)generation << 32) | ((uint64_t)l << 16) | r;
+
+    __atomic_store_n(&avr->speed_mailbox, mailbox, __ATOMIC_RELEASE);
+    wakeup_thread(avr);
+}
+
+// Set the minimum speed change (0 - 1) that is sent to the avr,
+// and how often an unchanged speed is repeated (0 to disable)
+void avr_set_speed_filter(struct avr *avr, double epsilon, uint32_t keepalive_ms)
+{
+    __atomic_store_n(&avr->speed_epsilon, (int16_t)(10000*epsilon), __ATOMIC_RELAXED);
+    __atomic_store_n(&avr->speed_keepalive_ms, keepalive_ms, __ATOMIC_RELAXED);
+    wakeup_thread(avr);
+}
+
+void avr_get_transmit_stats(struct avr *avr, struct avr_transmit_stats *stats)
+{
+    stats->bytes = __atomic_load_n(&avr->tx_bytes, __ATOMIC_RELAXED);
+    stats->frames = __atomic_load_n(&avr->tx_frames, __ATOMIC_RELAXED);
+    stats->queued = __atomic_load_n(&avr->tx_queued, __ATOMIC_RELAXED);
+}
+
+void avr_get_receive_stats(struct avr *avr, struct decoder_stats *stats)
+{
+    decoder_get_stats(avr->decoder, stats);
+}
+
+// Set the interval between round-trip time measurements (0 to disable)
+void avr_set_ping_interval(struct avr *avr, uint32_t interval_ms)
+{
+    __atomic_store_n(&avr->ping_interval_ms, interval_ms, __ATOMIC_RELAXED);
+    wakeup_thread(avr);
+}
+
+void avr_get_ping_stats(struct avr *avr, struct avr_ping_stats *stats)
+{
+    stats->sent = __atomic_load_n(&avr->pings_sent, __ATOMIC_RELAXED);
+    stats->received = __atomic_load_n(&avr->pongs_received, __ATOMIC_RELAXED);
+    histogram_snapshot(&avr->ping_rtt, &stats->rtt);
+}
+
+// Set the age (ms) after which the avr should ignore a speed (0 to disable).
+// Deadlines are only applied once a ping has synchronized the clocks.
+void avr_set_speed_max_age(struct avr *avr, uint32_t max_age_ms)
+{
+    __atomic_store_n(&avr->speed_max_age_ms, max_age_ms, __ATOMIC_RELAXED);
+}
 
-    printf("Sending speed packet: %u %u\n", speed.left, speed.right);
-    queue_data(avr, SPEED, &speed, sizeof(struct packet_speed));
+void avr_get_speed_stats(struct avr *avr, struct avr_speed_stats *stats)
+{
+    stats->sent = __atomic_load_n(&avr->speeds_sent, __ATOMIC_RELAXED);
+    stats->expired = __atomic_load_n(&avr->speeds_expired, __ATOMIC_RELAXED);
+    stats->overwritten = __atomic_load_n(&avr->speeds_overwritten, __ATOMIC_RELAXED);
+    stats->suppressed = __atomic_load_n(&avr->speeds_suppressed, __ATOMIC_RELAXED);
+    stats->deferred = __atomic_load_n(&avr->speeds_deferred, __ATOMIC_RELAXED);
+    stats->deferring = __atomic_load_n(&avr->speed_deferring, __ATOMIC_RELAXED);
+}
+
+// Snapshot of the link state for display by clients
+void avr_get_telemetry(struct avr *avr, struct avr_telemetry *telemetry)
+{
+    uint64_t speed = __atomic_load_n(&avr->speed_telemetry, __ATOMIC_RELAXED);
+    telemetry->link_active = __atomic_load_n(&avr->link_active, __ATOMIC_RELAXED);
+    telemetry->speed_valid = speed >> 32;
+    telemetry->left = (int16_t)(speed >> 16);
+    telemetry->right = (int16_t)speed;
+    telemetry->rtt_us = __atomic_load_n(&avr->last_rtt_us, __ATOMIC_RELAXED);
+    telemetry->baud = __atomic_load_n(&avr->baud_current, __ATOMIC_RELAXED);
+}
+
+// Set the scheduling priority and cpu affinity of the worker thread
+void avr_set_realtime(struct avr *avr, const struct realtime_config *config)
+{
+    avr->realtime = *config;
+    __atomic_store_n(&avr->realtime_requested, true, __ATOMIC_RELEASE);
+    wakeup_thread(avr);
+}
+
+// Record serial traffic to capture, or stop recording if NULL.
+// The capture must stay open until avr_free.
+void avr_set_capture(struct avr *avr, struct capture *capture)
+{
+    __atomic_store_n(&avr->capture, capture, __ATOMIC_RELEASE);
+}
+
+void avr_get_wakeup_latency(struct avr *avr, struct histogram *latency)
+{
+    histogram_snapshot(&avr->wakeup_latency, latency);
+}
+
+// Set the framing version (1 or 2) to negotiate with the avr
+void avr_set_framing(struct avr *avr, uint8_t version)
+{
+    __atomic_store_n(&avr->framing_requested, version, __ATOMIC_RELAXED);
+    wakeup_thread(avr);
+}
+
+// Framing version currently in use
+uint8_t avr_get_framing(struct avr *avr)
+{
+    return __atomic_load_n(&avr->framing_version, __ATOMIC_RELAXED);
+}
+
+// Set the fastest line rate to negotiate with the avr.
+// Must be called before the link is established.
+void avr_set_max_baud(struct avr *avr, uint32_t baud)
+{
+    __atomic_store_n(&avr->baud_max, baud, __ATOMIC_RELAXED);
+    wakeup_thread(avr);
+}
+
+void avr_get_baud_stats(struct avr *avr, struct avr_baud_stats *stats)
+{
+    stats->current = __atomic_load_n(&avr->baud_current, __ATOMIC_RELAXED);
+    stats->count = __atomic_load_n(&avr->baud_result_count, __ATOMIC_ACQUIRE);
+    memcpy(stats->results, avr->baud_results, stats->count * sizeof(struct avr_baud_result));
 }
@@ -12,11 +12,105 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "capture.h"
+#include "decoder.h"
+#include "histogram.h"
+#include "realtime.h"
 
-struct avr *avr_new(const char *port, uint32_t baud);
+// Outcome of testing one line rate
+struct avr_baud_result
+{
+    uint32_t rate;
+    bool accepted;
+    bool selected;
+    uint32_t pings;
+    uint32_t pongs;
+    uint32_t errors;
+};
+
+#define AVR_MAX_BAUD_RESULTS 8
+struct avr_baud_stats
+{
+    uint32_t current;
+    uint8_t count;
+    struct avr_baud_result results[AVR_MAX_BAUD_RESULTS];
+};
+
+struct avr_telemetry
+{
+    bool link_active;
+
+    // Speed last sent to the avr, using -10000 - 10000 for -1 - 1
+    bool speed_valid;
+    int16_t left;
+    int16_t right;
+
+    // Most recent round-trip time, or 0 if unknown
+    uint32_t rtt_us;
+    uint32_t baud;
+};
+
+struct avr_transmit_stats
+{
+    uint64_t bytes;
+    uint64_t frames;
+
+    // Bytes waiting to be sent when the port was last serviced
+    uint32_t queued;
+};
+
+struct avr_speed_stats
+{
+    uint64_t sent;
+
+    // Discarded by the avr because they arrived after their deadline
+    uint64_t expired;
+
+    // Requests replaced in the mailbox before they were sent, and
+    // requests not sent because they were within the speed epsilon
+    uint64_t overwritten;
+    uint64_t suppressed;
+
+    // Requests held back while earlier data was still being written,
+    // and whether one is being held back now
+    uint64_t deferred;
+    bool deferring;
+};
+
+struct avr_ping_stats
+{
+    uint64_t sent;
+    uint64_t received;
+
+    // Round-trip times in ns
+    struct histogram rtt;
+};
+
+// Called on the avr thread for each debug message received
+typedef void (*avr_message_handler)(void *context, const char *message, size_t length);
+
+struct avr *avr_new(const char *port, uint32_t baud, avr_message_handler handler, void *context);
+struct avr *avr_new_polled(const char *port, uint32_t baud, avr_message_handler handler, void *context);
+int avr_poll_fd(struct avr *avr, short *events);
+bool avr_service(struct avr *avr, short revents, int *timeout_ms);
 void avr_free(struct avr *avr);
 void avr_shutdown(struct avr *avr);
 bool avr_thread_alive(struct avr *avr);
 void avr_set_speed(struct avr *avr, double left, double right);
+void avr_set_speed_filter(struct avr *avr, double epsilon, uint32_t keepalive_ms);
+void avr_set_speed_max_age(struct avr *avr, uint32_t max_age_ms);
+void avr_get_speed_stats(struct avr *avr, struct avr_speed_stats *stats);
+void avr_get_transmit_stats(struct avr *avr, struct avr_transmit_stats *stats);
+void avr_get_receive_stats(struct avr *avr, struct decoder_stats *stats);
+void avr_set_ping_interval(struct avr *avr, uint32_t interval_ms);
+void avr_get_ping_stats(struct avr *avr, struct avr_ping_stats *stats);
+void avr_get_telemetry(struct avr *avr, struct avr_telemetry *telemetry);
+void avr_set_realtime(struct avr *avr, const struct realtime_config *config);
+void avr_set_capture(struct avr *avr, struct capture *capture);
+void avr_get_wakeup_latency(struct avr *avr, struct histogram *latency);
+void avr_set_framing(struct avr *avr, uint8_t version);
+uint8_t avr_get_framing(struct avr *avr);
+void avr_set_max_baud(struct avr *avr, uint32_t baud);
+void avr_get_baud_stats(struct avr *avr, struct avr_baud_stats *stats);
 
 #endif
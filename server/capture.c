@@ -0,0 +1,199 @@
+//*****************************************************************************
+//  Timestamped capture of serial and websocket traffic for later replay
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "capture.h"
+#include "log.h"
+#include "timing.h"
+
+#define CAPTURE_ALIGN(length) (((length) + 7) & ~(size_t)7)
+
+// The file is mapped at its full size up front. Writers reserve space
+// by advancing used, so the avr and web threads never wait for each
+// other, and the kernel writes the pages back in the background.
+struct capture
+{
+    int fd;
+    uint8_t *map;
+    size_t size;
+    uint64_t start_ns;
+
+    size_t used;
+    uint64_t records;
+    uint64_t dropped;
+};
+
+struct capture_reader
+{
+    uint8_t *map;
+    size_t size;
+    size_t offset;
+};
+
+struct capture *capture_open(const char *path, size_t size)
+{
+    size = CAPTURE_ALIGN(size);
+    if (size < sizeof(struct capture_header))
+        return NULL;
+
+    struct capture *capture = calloc(1, sizeof(struct capture));
+    if (!capture)
+        return NULL;
+
+    capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (capture->fd == -1)
+    {
+        log_error("Failed to open capture %s\n", path);
+        free(capture);
+        return NULL;
+    }
+
+    if (ftruncate(capture->fd, size) == -1)
+    {
+        log_error("Failed to reserve %zu bytes for capture %s\n", size, path);
+        close(capture->fd);
+        free(capture);
+        return NULL;
+    }
+
+    capture->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+    if (capture->map == MAP_FAILED)
+    {
+        log_error("Failed to map capture %s; errno %d (%s)\n", path, errno, strerror(errno));
+        close(capture->fd);
+        free(capture);
+        return NULL;
+    }
+
+    capture->size = size;
+    capture->start_ns = timing_now_ns();
+    capture->used = sizeof(struct capture_header);
+
+    struct capture_header header = {
+        .version = CAPTURE_VERSION,
+        .start_ns = capture->start_ns
+    };
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    memcpy(capture->map, &header, sizeof(header));
+
+    log_info("Capturing traffic to %s (%zu bytes)\n", path, size);
+    return capture;
+}
+
+// Only call once all writers have stopped
+void capture_close(struct capture *capture)
+{
+    if (capture->used > capture->size)
+        capture->used = capture->size;
+
+    msync(capture->map, capture->used, MS_SYNC);
+    munmap(capture->map, capture->size);
+
+    // Trim the unused reservation
+    if (ftruncate(capture->fd, capture->used) == -1)
+        log_error("Failed to trim capture\n");
+
+    close(capture->fd);
+    free(capture);
+}
+
+void capture_write(struct capture *capture, enum capture_source source, uint8_t flags,
+                   uint16_t session, const void *data, size_t length)
+{
+    size_t total = sizeof(struct capture_record) + CAPTURE_ALIGN(length);
+    size_t offset = __atomic_fetch_add(&capture->used, total, __ATOMIC_RELAXED);
+    // used only grows, so once one record is dropped every later
+    // record is dropped too, and the capture has no holes
+    if (offset + total > capture->size || length > UINT32_MAX)
+    {
+        __atomic_fetch_add(&capture->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct capture_record *record = (struct capture_record *)&capture->map[offset];
+    record->length = length;
+    record->flags = flags;
+    record->session = session;
+    record->time_ns = timing_now_ns() - capture->start_ns;
+    memcpy(&record[1], data, length);
+    __atomic_store_n(&record->source, source, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&capture->records, 1, __ATOMIC_RELAXED);
+}
+
+void capture_get_stats(struct capture *capture, struct capture_stats *stats)
+{
+    size_t used = __atomic_load_n(&capture->used, __ATOMIC_RELAXED);
+    stats->size = capture->size;
+    stats->used = used < capture->size ? used : capture->size;
+    stats->records = __atomic_load_n(&capture->records, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&capture->dropped, __ATOMIC_RELAXED);
+}
+
+struct capture_reader *capture_reader_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct capture_header))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const struct capture_header *header = (const struct capture_header *)map;
+    struct capture_reader *reader = calloc(1, sizeof(struct capture_reader));
+    if (!reader || memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) ||
+        header->version != CAPTURE_VERSION)
+    {
+        free(reader);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    reader->map = map;
+    reader->size = st.st_size;
+    reader->offset = sizeof(struct capture_header);
+    return reader;
+}
+
+void capture_reader_close(struct capture_reader *reader)
+{
+    munmap(reader->map, reader->size);
+    free(reader);
+}
+
+// Returns false at the end of the capture
+bool capture_reader_next(struct capture_reader *reader, const struct capture_record **record, const uint8_t **data)
+{
+    if (reader->offset + sizeof(struct capture_record) > reader->size)
+        return false;
+
+    const struct capture_record *r = (const struct capture_record *)&reader->map[reader->offset];
+    size_t total = sizeof(struct capture_record) + CAPTURE_ALIGN((size_t)r->length);
+    if (r->source == 0 || reader->offset + total > reader->size)
+        return false;
+
+    *record = r;
+    *data = (const uint8_t *)&r[1];
+    reader->offset += total;
+    return true;
+}
@@ -0,0 +1,86 @@
+//*****************************************************************************
+//  Timestamped capture of serial and websocket traffic for later replay
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_CAPTURE_H
+#define TANKBOT_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Space reserved for a capture file. Records that don't fit are dropped.
+#define CAPTURE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+#define CAPTURE_MAGIC "TBCAPTUR"
+#define CAPTURE_VERSION 1
+
+enum capture_source
+{
+    // Bytes read from and written to the serial port
+    CAPTURE_SERIAL_RECEIVE = 1,
+    CAPTURE_SERIAL_SEND = 2,
+
+    // Websocket sessions opening and closing, and messages from clients
+    CAPTURE_WEBSOCKET_OPEN = 3,
+    CAPTURE_WEBSOCKET_CLOSE = 4,
+    CAPTURE_WEBSOCKET_RECEIVE = 5
+};
+
+// Set on websocket records for the tankbot-binary subprotocol
+#define CAPTURE_FLAG_BINARY 0x01
+
+struct __attribute__((__packed__)) capture_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+
+    // timing_now_ns() when the capture started
+    uint64_t start_ns;
+};
+
+// Each record is followed by length bytes of data, padded to a multiple
+// of eight bytes. The source is written last, so a record with a zero
+// source marks the end of a capture that wasn't closed cleanly.
+struct __attribute__((__packed__)) capture_record
+{
+    uint32_t length;
+    uint8_t source;
+    uint8_t flags;
+
+    // Websocket file descriptor, or 0 for serial records
+    uint16_t session;
+
+    // Time since the capture started
+    uint64_t time_ns;
+};
+
+struct capture_stats
+{
+    size_t size;
+    size_t used;
+    uint64_t records;
+    uint64_t dropped;
+};
+
+// Writing, from any number of threads
+struct capture;
+struct capture *capture_open(const char *path, size_t size);
+void capture_close(struct capture *capture);
+void capture_write(struct capture *capture, enum capture_source source, uint8_t flags,
+                   uint16_t session, const void *data, size_t length);
+void capture_get_stats(struct capture *capture, struct capture_stats *stats);
+
+// Reading a complete or interrupted capture
+struct capture_reader;
+struct capture_reader *capture_reader_open(const char *path);
+void capture_reader_close(struct capture_reader *reader);
+bool capture_reader_next(struct capture_reader *reader, const struct capture_record **record, const uint8_t **data);
+
+#endif
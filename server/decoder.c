@@ -0,0 +1,272 @@
+//*****************************************************************************
+//  Streaming packet decoder for data received from the ArduPilot
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "decoder.h"
+#include "log.h"
+#include "../framing.h"
+
+// Received data is read directly into buffer[end..size).
+// Bytes in buffer[start..end) have not yet been decoded.
+struct decoder
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t start;
+    size_t end;
+
+    // Framing version, and the next expected version 2 sequence number
+    uint8_t version;
+    uint8_t sequence;
+    bool sequence_valid;
+
+    // Written atomically by the decoding thread so that decoder_get_stats
+    // can be called from any thread
+    struct decoder_stats stats;
+};
+
+struct decoder *decoder_new(size_t size)
+{
+    // The buffer must be able to hold at least one complete frame
+    if (size < FRAMING_MAX_LENGTH)
+        return NULL;
+
+    struct decoder *decoder = calloc(1, sizeof(struct decoder));
+    if (!decoder)
+        return NULL;
+
+    decoder->buffer = malloc(size);
+    if (!decoder->buffer)
+    {
+        free(decoder);
+        return NULL;
+    }
+
+    decoder->size = size;
+    decoder->version = 1;
+    return decoder;
+}
+
+void decoder_free(struct decoder *decoder)
+{
+    free(decoder->buffer);
+    free(decoder);
+}
+
+// Return the space available for new data, moving any
+// partially received frame to the start of the buffer.
+// Invalidates frames returned by decoder_next.
+uint8_t *decoder_write_buffer(struct decoder *decoder, size_t *space)
+{
+    if (decoder->start > 0)
+    {
+        memmove(decoder->buffer, &decoder->buffer[decoder->start], decoder->end - decoder->start);
+        decoder->end -= decoder->start;
+        decoder->start = 0;
+    }
+
+    *space = decoder->size - decoder->end;
+    return &decoder->buffer[decoder->end];
+}
+
+// Mark length bytes of the write buffer as received
+void decoder_commit(struct decoder *decoder, size_t length)
+{
+    decoder->end += length;
+    __atomic_fetch_add(&decoder->stats.bytes, length, __ATOMIC_RELAXED);
+}
+
+// Discard bytes that can't be part of a valid frame
+static void discard(struct decoder *decoder, size_t length)
+{
+    decoder->start += length;
+    __atomic_fetch_add(&decoder->stats.discarded_bytes, length, __ATOMIC_RELAXED);
+}
+
+// Find and validate the next zero-delimited version 2 frame
+static bool next_v2(struct decoder *decoder, struct decoder_frame *frame)
+{
+    while (decoder->start < decoder->end)
+    {
+        uint8_t *p = &decoder->buffer[decoder->start];
+        size_t available = decoder->end - decoder->start;
+
+        uint8_t *delimiter = memchr(p, FRAMING_V2_DELIMITER, available);
+        if (!delimiter)
+        {
+            // Drop data that can no longer fit in a valid frame
+            if (available >= FRAMING_V2_MAX_LENGTH)
+            {
+                log_warning("Ignoring long frame (%zu bytes without delimiter)\n", available);
+                __atomic_fetch_add(&decoder->stats.long_packets, 1, __ATOMIC_RELAXED);
+                discard(decoder, available);
+            }
+            break;
+        }
+
+        size_t length = delimiter - p;
+        if (length == 0)
+        {
+            discard(decoder, 1);
+            continue;
+        }
+
+        if (length >= FRAMING_V2_MAX_LENGTH)
+        {
+            log_warning("Ignoring long frame (length %zu)\n", length);
+            __atomic_fetch_add(&decoder->stats.long_packets, 1, __ATOMIC_RELAXED);
+            discard(decoder, length + 1);
+            continue;
+        }
+
+        uint8_t type, sequence, *data;
+        int16_t data_length = framing_decode_v2(p, length, &type, &sequence, &data);
+        if (data_length < 0)
+        {
+            log_warning("Frame CRC or encoding check failed (length %zu)\n", length);
+            __atomic_fetch_add(&decoder->stats.crc_failures, 1, __ATOMIC_RELAXED);
+            discard(decoder, length + 1);
+            continue;
+        }
+
+        if (decoder->sequence_valid && sequence != decoder->sequence)
+        {
+            uint8_t lost = sequence - decoder->sequence;
+            log_warning("Lost %u packets before sequence %u\n", lost, sequence);
+            __atomic_fetch_add(&decoder->stats.sequence_gaps, lost, __ATOMIC_RELAXED);
+        }
+
+        decoder->sequence = sequence + 1;
+        decoder->sequence_valid = true;
+
+        frame->type = type;
+        frame->data = data;
+        frame->length = data_length;
+        frame->sequence = sequence;
+
+        decoder->start += length + 1;
+        __atomic_fetch_add(&decoder->stats.frames, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    return false;
+}
+
+// Find and validate the next complete frame in the buffer.
+// Returns false if more data is needed.
+bool decoder_next(struct decoder *decoder, struct decoder_frame *frame)
+{
+    if (decoder->version == 2)
+        return next_v2(decoder, frame);
+
+    while (decoder->start < decoder->end)
+    {
+        uint8_t *p = &decoder->buffer[decoder->start];
+        size_t available = decoder->end - decoder->start;
+
+        // Synchronize to packet header
+        uint8_t *header = memchr(p, '$', available);
+        if (!header)
+        {
+            discard(decoder, available);
+            break;
+        }
+
+        if (header != p)
+        {
+            discard(decoder, header - p);
+            continue;
+        }
+
+        if (available < 4)
+            break;
+
+        // Packet types are never '$', so a third '$' means
+        // that the real header starts at the next byte
+        if (p[1] != '$' || p[2] == '$')
+        {
+            discard(decoder, 1);
+            continue;
+        }
+
+        uint8_t type = p[2];
+        uint8_t length = p[3];
+        if (length > sizeof(union packet_data))
+        {
+            log_warning("Ignoring long packet: %c (length %u)\n", type, length);
+            __atomic_fetch_add(&decoder->stats.long_packets, 1, __ATOMIC_RELAXED);
+            discard(decoder, 1);
+            continue;
+        }
+
+        if (available < (size_t)length + PACKET_FRAME_OVERHEAD)
+            break;
+
+        const uint8_t *data = &p[4];
+        uint8_t checksum = 0;
+        for (uint8_t i = 0; i < length; i++)
+            checksum ^= data[i];
+
+        if (checksum != data[length])
+        {
+            log_warning("Packet checksum failed. Got 0x%02x, expected 0x%02x.\n", data[length], checksum);
+            __atomic_fetch_add(&decoder->stats.checksum_failures, 1, __ATOMIC_RELAXED);
+            discard(decoder, 1);
+            continue;
+        }
+
+        if (data[length + 1] != '\r' || data[length + 2] != '\n')
+        {
+            log_warning("Invalid packet end bytes. Got 0x%02x 0x%02x, expected 0x%02x 0x%02x.\n",
+                        data[length + 1], data[length + 2], '\r', '\n');
+            __atomic_fetch_add(&decoder->stats.footer_failures, 1, __ATOMIC_RELAXED);
+            discard(decoder, 1);
+            continue;
+        }
+
+        frame->type = type;
+        frame->data = data;
+        frame->length = length;
+        frame->sequence = 0;
+
+        decoder->start += length + PACKET_FRAME_OVERHEAD;
+        __atomic_fetch_add(&decoder->stats.frames, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    return false;
+}
+
+// Switch framing version. Undecoded data is kept and
+// interpreted using the new version.
+void decoder_set_version(struct decoder *decoder, uint8_t version)
+{
+    decoder->version = version;
+    decoder->sequence_valid = false;
+}
+
+uint8_t decoder_version(struct decoder *decoder)
+{
+    return decoder->version;
+}
+
+void decoder_get_stats(struct decoder *decoder, struct decoder_stats *stats)
+{
+    const struct decoder_stats *s = &decoder->stats;
+    stats->bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    stats->frames = __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+    stats->discarded_bytes = __atomic_load_n(&s->discarded_bytes, __ATOMIC_RELAXED);
+    stats->long_packets = __atomic_load_n(&s->long_packets, __ATOMIC_RELAXED);
+    stats->checksum_failures = __atomic_load_n(&s->checksum_failures, __ATOMIC_RELAXED);
+    stats->footer_failures = __atomic_load_n(&s->footer_failures, __ATOMIC_RELAXED);
+    stats->crc_failures = __atomic_load_n(&s->crc_failures, __ATOMIC_RELAXED);
+    stats->sequence_gaps = __atomic_load_n(&s->sequence_gaps, __ATOMIC_RELAXED);
+}
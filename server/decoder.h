@@ -0,0 +1,54 @@
+//*****************************************************************************
+//  Streaming packet decoder for data received from the ArduPilot
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_DECODER_H
+#define TANKBOT_DECODER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../protocol.h"
+
+// A decoded packet. data points into the decoder buffer and is only
+// valid until the next call to decoder_write_buffer.
+struct decoder_frame
+{
+    enum packet_type type;
+    const uint8_t *data;
+    uint8_t length;
+
+    // Only set by version 2 framing
+    uint8_t sequence;
+};
+
+struct decoder_stats
+{
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t discarded_bytes;
+    uint64_t long_packets;
+    uint64_t checksum_failures;
+    uint64_t footer_failures;
+
+    // Version 2 framing
+    uint64_t crc_failures;
+    uint64_t sequence_gaps;
+};
+
+struct decoder;
+struct decoder *decoder_new(size_t size);
+void decoder_free(struct decoder *decoder);
+uint8_t *decoder_write_buffer(struct decoder *decoder, size_t *space);
+void decoder_commit(struct decoder *decoder, size_t length);
+bool decoder_next(struct decoder *decoder, struct decoder_frame *frame);
+void decoder_set_version(struct decoder *decoder, uint8_t version);
+uint8_t decoder_version(struct decoder *decoder);
+void decoder_get_stats(struct decoder *decoder, struct decoder_stats *stats);
+
+#endif
@@ -0,0 +1,102 @@
+//*****************************************************************************
+//  Log-bucketed latency histogram
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <string.h>
+#include "histogram.h"
+
+// Values below 2 * HISTOGRAM_SUB_BUCKETS are stored exactly.
+// Larger values keep only their leading HISTOGRAM_SUB_BUCKET_BITS + 1 bits.
+static unsigned int bucket_index(uint64_t value)
+{
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+        return (unsigned int)value;
+
+    unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    unsigned int sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Midpoint of the range of values stored in a bucket
+static uint64_t bucket_value(unsigned int index)
+{
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub) << shift) + (1ULL << shift) / 2;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    // Only one thread records, so plain read-modify-write is safe;
+    // the atomic stores keep concurrent snapshots tear-free
+    uint64_t count = histogram->count;
+    if (count == 0 || value < histogram->min)
+        __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+    if (count == 0 || value > histogram->max)
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+
+    unsigned int index = bucket_index(value);
+    __atomic_store_n(&histogram->counts[index], histogram->counts[index] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// Copy a histogram that may be concurrently updated.
+// The total is recomputed from the buckets so that percentiles are consistent.
+void histogram_snapshot(struct histogram *histogram, struct histogram *snapshot)
+{
+    memset(snapshot, 0, sizeof(struct histogram));
+    if (__atomic_load_n(&histogram->count, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        snapshot->counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        snapshot->count += snapshot->counts[i];
+    }
+
+    snapshot->sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    snapshot->min = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED);
+    snapshot->max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+// Value below which the given fraction (0 - 1) of recorded values fall
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(percentile * histogram->count + 0.5);
+    if (target == 0)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= target)
+        {
+            uint64_t value = bucket_value(i);
+            if (value < histogram->min)
+                return histogram->min;
+            if (value > histogram->max)
+                return histogram->max;
+            return value;
+        }
+    }
+
+    return histogram->max;
+}
+
+uint64_t histogram_mean(const struct histogram *histogram)
+{
+    return histogram->count ? histogram->sum / histogram->count : 0;
+}
@@ -0,0 +1,36 @@
+//*****************************************************************************
+//  Log-bucketed latency histogram
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_HISTOGRAM_H
+#define TANKBOT_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Each power of two is split into 2^HISTOGRAM_SUB_BUCKET_BITS linear
+// buckets, giving a worst-case relative error of about 3%
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Values may be recorded by one thread while others take snapshots
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+void histogram_record(struct histogram *histogram, uint64_t value);
+void histogram_snapshot(struct histogram *histogram, struct histogram *snapshot);
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+uint64_t histogram_mean(const struct histogram *histogram);
+
+#endif
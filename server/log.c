@@ -0,0 +1,539 @@
+//*****************************************************************************
+//  Asynchronous binary logging
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "ringbuffer.h"
+#include "timing.h"
+
+// Ring size for each thread that logs
+#define LOG_RING_SIZE 65536
+
+// Largest record, and longest string argument, that will be stored
+#define LOG_MAX_RECORD 1024
+#define LOG_MAX_STRING 255
+
+// Records gathered from all threads per drain pass
+#define LOG_STAGING_SIZE 65536
+#define LOG_STAGING_RECORDS 1024
+
+// Interval between drain passes, in ms
+#define LOG_DRAIN_INTERVAL 10
+
+enum log_arg
+{
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING,
+
+    // A string bounded by a '*' precision argument, which may not be terminated
+    LOG_ARG_STRING_PRECISION,
+
+    // A '*' width or precision
+    LOG_ARG_STAR
+};
+
+// Each record is stored as: uint16_t size, format pointer, uint64_t time,
+// then 8 bytes per numeric argument or a length byte and the contents of
+// each string argument
+#define LOG_HEADER_SIZE (sizeof(uint16_t) + sizeof(struct log_format *) + sizeof(uint64_t))
+
+// A ring owned by one logging thread
+struct log_thread
+{
+    struct ringbuffer *ring;
+    bool exited;
+    struct log_thread *next;
+};
+
+struct log_entry
+{
+    uint64_t time;
+    const uint8_t *record;
+};
+
+int log_level = LOG_LEVEL_NONE;
+
+static bool initialized = false;
+static bool shutdown_requested = false;
+static pthread_t drain_thread;
+static pthread_key_t thread_key;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_thread *threads = NULL;
+static uint64_t dropped = 0;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+
+// Skip a conversion specification, returning the argument types it consumes.
+// p points at the character after the '%'.
+static const char *parse_spec(const char *p, uint8_t *args, uint8_t *count)
+{
+    *count = 0;
+    while (*p && strchr("-+ #0", *p))
+        p++;
+
+    if (*p == '*')
+    {
+        args[(*count)++] = LOG_ARG_STAR;
+        p++;
+    }
+    else
+        while (*p >= '0' && *p <= '9')
+            p++;
+
+    bool star_precision = false;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            args[(*count)++] = LOG_ARG_STAR;
+            star_precision = true;
+            p++;
+        }
+        else
+            while (*p >= '0' && *p <= '9')
+                p++;
+    }
+
+    uint8_t integer = LOG_ARG_INT;
+    switch (*p)
+    {
+    case 'h':
+        p += (p[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        integer = (p[1] == 'l') ? LOG_ARG_LLONG : LOG_ARG_LONG;
+        p += (p[1] == 'l') ? 2 : 1;
+        break;
+    case 'z':
+        integer = LOG_ARG_SIZE;
+        p++;
+        break;
+    }
+
+    switch (*p)
+    {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        args[(*count)++] = integer;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        args[(*count)++] = LOG_ARG_DOUBLE;
+        break;
+    case 'p':
+        args[(*count)++] = LOG_ARG_POINTER;
+        break;
+    case 's':
+        args[(*count)++] = star_precision ? LOG_ARG_STRING_PRECISION : LOG_ARG_STRING;
+        break;
+    case '%':
+        break;
+    default:
+        // Unsupported: formatting stops here
+        return NULL;
+    }
+
+    return p + 1;
+}
+
+static void parse_format(struct log_format *format, const char *fmt)
+{
+    uint8_t count = 0;
+    const char *p = fmt;
+    while ((p = strchr(p, '%')))
+    {
+        uint8_t args[3], n;
+        p = parse_spec(p + 1, args, &n);
+        if (!p || count + n > LOG_MAX_ARGS)
+            break;
+
+        memcpy(&format->args[count], args, n);
+        count += n;
+    }
+
+    format->format = fmt;
+    format->arg_count = count;
+    __atomic_store_n(&format->parsed, true, __ATOMIC_RELEASE);
+}
+
+static void thread_exited(void *data)
+{
+    struct log_thread *thread = data;
+    __atomic_store_n(&thread->exited, true, __ATOMIC_RELEASE);
+}
+
+// Find or create the ring for the calling thread
+static struct log_thread *current_thread()
+{
+    struct log_thread *thread = pthread_getspecific(thread_key);
+    if (thread)
+        return thread;
+
+    thread = calloc(1, sizeof(struct log_thread));
+    if (!thread)
+        return NULL;
+
+    thread->ring = ringbuffer_new(LOG_RING_SIZE);
+    if (!thread->ring)
+    {
+        free(thread);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&threads_mutex);
+    thread->next = threads;
+    threads = thread;
+    pthread_mutex_unlock(&threads_mutex);
+
+    pthread_setspecific(thread_key, thread);
+    return thread;
+}
+
+void log_write(struct log_format *format, const char *fmt, ...)
+{
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+        return;
+
+    if (!__atomic_load_n(&format->parsed, __ATOMIC_ACQUIRE))
+        parse_format(format, fmt);
+
+    struct log_thread *thread = current_thread();
+    if (!thread)
+        return;
+
+    uint8_t record[LOG_MAX_RECORD];
+    uint64_t now = timing_now_ns();
+    size_t size = sizeof(uint16_t);
+    memcpy(&record[size], &format, sizeof(struct log_format *));
+    size += sizeof(struct log_format *);
+    memcpy(&record[size], &now, sizeof(uint64_t));
+    size += sizeof(uint64_t);
+
+    va_list args;
+    va_start(args, fmt);
+    int64_t star = LOG_MAX_STRING;
+    for (uint8_t i = 0; i < format->arg_count; i++)
+    {
+        // Drop the remaining arguments if the record is full
+        if (size + sizeof(uint64_t) > LOG_MAX_RECORD)
+            break;
+
+        uint64_t value = 0;
+        switch (format->args[i])
+        {
+        case LOG_ARG_INT:
+            value = va_arg(args, int);
+            break;
+        case LOG_ARG_STAR:
+            star = va_arg(args, int);
+            value = star;
+            break;
+        case LOG_ARG_LONG:
+            value = va_arg(args, long);
+            break;
+        case LOG_ARG_LLONG:
+            value = va_arg(args, long long);
+            break;
+        case LOG_ARG_SIZE:
+            value = va_arg(args, size_t);
+            break;
+        case LOG_ARG_DOUBLE:
+            {
+                double d = va_arg(args, double);
+                memcpy(&value, &d, sizeof(double));
+            }
+            break;
+        case LOG_ARG_POINTER:
+            value = (uintptr_t)va_arg(args, void *);
+            break;
+        case LOG_ARG_STRING:
+        case LOG_ARG_STRING_PRECISION:
+            {
+                const char *s = va_arg(args, const char *);
+                size_t max = LOG_MAX_STRING;
+                if (format->args[i] == LOG_ARG_STRING_PRECISION && star >= 0 && star < LOG_MAX_STRING)
+                    max = star;
+                if (max > LOG_MAX_RECORD - size - 1)
+                    max = LOG_MAX_RECORD - size - 1;
+
+                size_t length = s ? strnlen(s, max) : 0;
+                record[size++] = length;
+                memcpy(&record[size], s, length);
+                size += length;
+            }
+            continue;
+        }
+
+        memcpy(&record[size], &value, sizeof(uint64_t));
+        size += sizeof(uint64_t);
+    }
+    va_end(args);
+
+    uint16_t record_size = size;
+    memcpy(record, &record_size, sizeof(uint16_t));
+    if (!ringbuffer_write(thread->ring, record, size))
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+}
+
+// Format one conversion from a record. spec is the conversion
+// specification with any '*' replaced by its value.
+static int format_arg(char *out, size_t n, const char *spec, uint8_t type, const uint8_t **data)
+{
+    uint64_t value;
+    if (type == LOG_ARG_STRING || type == LOG_ARG_STRING_PRECISION)
+    {
+        char s[LOG_MAX_STRING + 1];
+        uint8_t length = *(*data)++;
+        memcpy(s, *data, length);
+        s[length] = '\0';
+        *data += length;
+        return snprintf(out, n, spec, s);
+    }
+
+    memcpy(&value, *data, sizeof(uint64_t));
+    *data += sizeof(uint64_t);
+
+    switch (type)
+    {
+    case LOG_ARG_LONG:
+        return snprintf(out, n, spec, (long)value);
+    case LOG_ARG_LLONG:
+        return snprintf(out, n, spec, (long long)value);
+    case LOG_ARG_SIZE:
+        return snprintf(out, n, spec, (size_t)value);
+    case LOG_ARG_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &value, sizeof(double));
+            return snprintf(out, n, spec, d);
+        }
+    case LOG_ARG_POINTER:
+        return snprintf(out, n, spec, (void *)(uintptr_t)value);
+    default:
+        return snprintf(out, n, spec, (int)value);
+    }
+}
+
+// Expand a record into a complete message
+static void format_record(const uint8_t *record, char *out, size_t n)
+{
+    uint16_t size;
+    const struct log_format *format;
+    memcpy(&size, record, sizeof(uint16_t));
+    memcpy(&format, &record[sizeof(uint16_t)], sizeof(struct log_format *));
+
+    const uint8_t *data = &record[LOG_HEADER_SIZE];
+    const uint8_t *end = &record[size];
+    const char *p = format->format;
+    uint8_t arg = 0;
+    size_t length = 0;
+
+    while (*p && length + 1 < n)
+    {
+        if (*p != '%')
+        {
+            out[length++] = *p++;
+            continue;
+        }
+
+        uint8_t types[3], count;
+        const char *spec_end = parse_spec(p + 1, types, &count);
+        if (!spec_end || arg + count > format->arg_count)
+        {
+            // Copy anything that can't be expanded verbatim
+            size_t rest = strnlen(p, n - length - 1);
+            memcpy(&out[length], p, rest);
+            length += rest;
+            break;
+        }
+
+        if (count == 0)
+        {
+            out[length++] = '%';
+            p = spec_end;
+            continue;
+        }
+
+        // Arguments may have been dropped from a full record
+        if (data >= end)
+            break;
+
+        // Substitute '*' arguments into the specification
+        char spec[64];
+        size_t spec_length = 0;
+        for (const char *s = p; s < spec_end && spec_length + 12 < sizeof(spec); s++)
+        {
+            if (*s == '*')
+            {
+                uint64_t star;
+                memcpy(&star, data, sizeof(uint64_t));
+                data += sizeof(uint64_t);
+                arg++;
+                spec_length += snprintf(&spec[spec_length], sizeof(spec) - spec_length, "%d", (int)star);
+            }
+            else
+                spec[spec_length++] = *s;
+        }
+        spec[spec_length] = '\0';
+
+        int ret = format_arg(&out[length], n - length, spec, types[count - 1], &data);
+        if (ret > 0)
+            length += ((size_t)ret < n - length) ? (size_t)ret : n - length - 1;
+        arg++;
+        p = spec_end;
+    }
+
+    out[length] = '\0';
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    uint64_t x = ((const struct log_entry *)a)->time;
+    uint64_t y = ((const struct log_entry *)b)->time;
+    return (x > y) - (x < y);
+}
+
+// Copy pending records from every thread, and write them in time order.
+// Returns true if more records may be waiting.
+static bool drain()
+{
+    static uint8_t staging[LOG_STAGING_SIZE];
+    static struct log_entry entries[LOG_STAGING_RECORDS];
+    size_t used = 0;
+    size_t count = 0;
+    bool full = false;
+
+    pthread_mutex_lock(&threads_mutex);
+    struct log_thread **link = &threads;
+    while (*link)
+    {
+        struct log_thread *thread = *link;
+        bool exited = __atomic_load_n(&thread->exited, __ATOMIC_ACQUIRE);
+
+        while (ringbuffer_used(thread->ring) > 0)
+        {
+            if (count == LOG_STAGING_RECORDS || used + LOG_MAX_RECORD > LOG_STAGING_SIZE)
+            {
+                full = true;
+                break;
+            }
+
+            // Records are written whole, so the rest follows the size
+            uint16_t size;
+            ringbuffer_read(thread->ring, staging + used, sizeof(uint16_t));
+            memcpy(&size, staging + used, sizeof(uint16_t));
+            ringbuffer_read(thread->ring, staging + used + sizeof(uint16_t), size - sizeof(uint16_t));
+
+            entries[count].record = staging + used;
+            memcpy(&entries[count].time, staging + used + sizeof(uint16_t) + sizeof(struct log_format *), sizeof(uint64_t));
+            count++;
+            used += size;
+        }
+
+        // Release rings belonging to threads that have finished
+        if (exited && ringbuffer_used(thread->ring) == 0)
+        {
+            *link = thread->next;
+            ringbuffer_free(thread->ring);
+            free(thread);
+        }
+        else
+            link = &thread->next;
+    }
+    pthread_mutex_unlock(&threads_mutex);
+
+    qsort(entries, count, sizeof(struct log_entry), compare_entries);
+    for (size_t i = 0; i < count; i++)
+    {
+        char message[LOG_MAX_RECORD + LOG_MAX_STRING];
+        format_record(entries[i].record, message, sizeof(message));
+        fputs(message, stdout);
+    }
+
+    static uint64_t reported = 0;
+    uint64_t lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost != reported)
+    {
+        printf("%llu log messages dropped\n", (unsigned long long)(lost - reported));
+        reported = lost;
+    }
+
+    fflush(stdout);
+    return full;
+}
+
+static void *drain_loop(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&shutdown_requested, __ATOMIC_ACQUIRE))
+    {
+        if (!drain())
+            nanosleep(&(struct timespec){0, LOG_DRAIN_INTERVAL * 1000000}, NULL);
+    }
+
+    while (drain());
+    return NULL;
+}
+
+// Start the log thread. Messages are discarded until this is called.
+bool log_init(int level)
+{
+    if (pthread_key_create(&thread_key, thread_exited))
+        return false;
+
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+    if (pthread_create(&drain_thread, NULL, drain_loop, NULL))
+    {
+        __atomic_store_n(&initialized, false, __ATOMIC_RELEASE);
+        printf("Failed to spawn log thread\n");
+        return false;
+    }
+
+    log_set_level(level);
+    return true;
+}
+
+// Write all outstanding messages and stop the log thread
+void log_shutdown()
+{
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+        return;
+
+    log_set_level(LOG_LEVEL_NONE);
+    __atomic_store_n(&shutdown_requested, true, __ATOMIC_RELEASE);
+    pthread_join(drain_thread, NULL);
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+const char *log_level_name(int level)
+{
+    if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG)
+        return "none";
+    return level_names[level];
+}
+
+uint64_t log_dropped()
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+//*****************************************************************************
+//  Asynchronous binary logging
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_LOG_H
+#define TANKBOT_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum log_level
+{
+    LOG_LEVEL_NONE = -1,
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+#define LOG_MAX_ARGS 12
+
+// Describes one call site. The address identifies the format in log
+// records, and the argument types are parsed from the format string
+// on first use.
+struct log_format
+{
+    const char *format;
+    uint8_t arg_count;
+    uint8_t args[LOG_MAX_ARGS];
+    bool parsed;
+};
+
+// Messages above this level are discarded before any work is done
+extern int log_level;
+
+// Record a printf-style message. Arguments are copied in binary form
+// to a per-thread ring and formatted later by the log thread.
+#define log_message(level, ...) do { \
+    static struct log_format _log_format; \
+    if ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) \
+        log_write(&_log_format, __VA_ARGS__); \
+} while (0)
+
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+bool log_init(int level);
+void log_shutdown();
+void log_set_level(int level);
+const char *log_level_name(int level);
+uint64_t log_dropped();
+
+void log_write(struct log_format *format, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -6,17 +6,30 @@
 //*****************************************************************************
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
 
 #include "avr.h"
+#include "capture.h"
+#include "log.h"
+#include "realtime.h"
 #include "serial.h"
+#include "timing.h"
 #include "webserver.h"
 
 
 struct avr *avr;
 struct webserver *webserver;
+struct capture *capture;
+
+// Longest time to block in the webserver between checks for signals
+#define WEBSERVER_TICK_MS 50
+
+// How late webserver_tick returns after its timeout expires
+struct histogram web_latency;
 
 bool force_shutdown = false;
 void shutdown_handler(int foo)
@@ -24,24 +37,315 @@ void shutdown_handler(int foo)
     force_shutdown = true;
 }
 
+volatile bool stats_requested = false;
+void stats_handler(int foo)
+{
+    stats_requested = true;
+}
+
+volatile bool log_level_requested = false;
+void log_level_handler(int foo)
+{
+    log_level_requested = true;
+}
+
+static void print_stats()
+{
+    struct avr_transmit_stats transmit_stats;
+    avr_get_transmit_stats(avr, &transmit_stats);
+    printf("Sent %llu bytes, %llu packets; %u bytes queued\n", (unsigned long long)transmit_stats.bytes,
+           (unsigned long long)transmit_stats.frames, transmit_stats.queued);
+
+    struct decoder_stats receive_stats;
+    avr_get_receive_stats(avr, &receive_stats);
+    printf("Received %llu bytes, %llu packets; %llu checksum and %llu footer failures\n",
+           (unsigned long long)receive_stats.bytes, (unsigned long long)receive_stats.frames,
+           (unsigned long long)receive_stats.checksum_failures,
+           (unsigned long long)receive_stats.footer_failures);
+    printf("Framing version %u; %llu CRC failures, %llu packets lost\n", avr_get_framing(avr),
+           (unsigned long long)receive_stats.crc_failures,
+           (unsigned long long)receive_stats.sequence_gaps);
+
+    struct avr_baud_stats baud_stats;
+    avr_get_baud_stats(avr, &baud_stats);
+    printf("Baud rate %u\n", baud_stats.current);
+    for (uint8_t i = 0; i < baud_stats.count; i++)
+    {
+        const struct avr_baud_result *r = &baud_stats.results[i];
+        if (!r->accepted)
+            printf("  %u: rejected by avr\n", r->rate);
+        else
+            printf("  %u: %u of %u pings returned, %u frame errors%s\n", r->rate, r->pongs,
+                   r->pings, r->errors, r->selected ? " (selected)" : "");
+    }
+
+    struct avr_speed_stats speed_stats;
+    avr_get_speed_stats(avr, &speed_stats);
+    printf("Speed: %llu sent, %llu arrived after their deadline\n",
+           (unsigned long long)speed_stats.sent, (unsigned long long)speed_stats.expired);
+    printf("Speed mailbox: %llu overwritten, %llu suppressed, %llu deferred%s\n",
+           (unsigned long long)speed_stats.overwritten, (unsigned long long)speed_stats.suppressed,
+           (unsigned long long)speed_stats.deferred, speed_stats.deferring ? " (waiting now)" : "");
+
+    struct avr_ping_stats ping_stats;
+    avr_get_ping_stats(avr, &ping_stats);
+    const struct histogram *rtt = &ping_stats.rtt;
+    printf("Ping: %llu sent, %llu received; RTT p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+           (unsigned long long)ping_stats.sent, (unsigned long long)ping_stats.received,
+           histogram_percentile(rtt, 0.5) / 1e3, histogram_percentile(rtt, 0.99) / 1e3,
+           histogram_percentile(rtt, 0.999) / 1e3, rtt->max / 1e3);
+
+    struct histogram serial_latency;
+    avr_get_wakeup_latency(avr, &serial_latency);
+    printf("Wakeup latency: serial p50 %.1f us, p99 %.1f us, max %.1f us; web p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           histogram_percentile(&serial_latency, 0.5) / 1e3, histogram_percentile(&serial_latency, 0.99) / 1e3,
+           serial_latency.max / 1e3, histogram_percentile(&web_latency, 0.5) / 1e3,
+           histogram_percentile(&web_latency, 0.99) / 1e3, web_latency.max / 1e3);
+
+    printf("Log: %llu messages dropped\n", (unsigned long long)log_dropped());
+
+    if (capture)
+    {
+        struct capture_stats capture_stats;
+        capture_get_stats(capture, &capture_stats);
+        printf("Capture: %llu records, %zu of %zu bytes used, %llu dropped\n",
+               (unsigned long long)capture_stats.records, capture_stats.used, capture_stats.size,
+               (unsigned long long)capture_stats.dropped);
+    }
+
+    // The webserver is freed before the final report
+    if (webserver)
+    {
+        struct webserver_stats web_stats;
+        webserver_get_stats(webserver, &web_stats);
+        printf("Debug message ring: %zu bytes (%zu slots of %zu bytes)\n",
+               web_stats.ring_bytes, web_stats.ring_slots, web_stats.ring_slot_size);
+        printf("Debug messages: %u queued, %llu skipped by slow clients\n",
+               web_stats.messages_written, (unsigned long long)web_stats.messages_skipped);
+        if (web_stats.batches)
+            printf("Debug message batches: %llu, averaging %.1f messages\n",
+                   (unsigned long long)web_stats.batches, (double)web_stats.batched_messages / web_stats.batches);
+        struct histogram delivery;
+        webserver_get_delivery_latency(webserver, &delivery);
+        printf("Debug message delivery: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               histogram_percentile(&delivery, 0.5) / 1e3, histogram_percentile(&delivery, 0.99) / 1e3,
+               delivery.max / 1e3);
+        printf("Web sessions: socket full %llu times, %u disconnected for lagging\n",
+               (unsigned long long)web_stats.sessions_choked, web_stats.sessions_disconnected);
+    }
+}
+
+// Forward debug messages from the avr thread to connected clients
+static void forward_debug_message(void *context, const char *message, size_t length)
+{
+    webserver_send_debug(context, message, length);
+}
+
+static void print_usage()
+{
+    printf("Usage: tankbotserver [options]\n");
+    printf("  -d <path>       serial port connected to the avr (default /dev/tty.iap)\n");
+    printf("  -b <baud>       initial serial baud rate (default 115200)\n");
+    printf("  -B <baud>       fastest baud rate to negotiate (default 1000000, 0 disables)\n");
+    printf("  -e <epsilon>    minimum speed change sent to the avr (0 - 1)\n");
+    printf("  -k <ms>         resend an unchanged speed this often (0 disables)\n");
+    printf("  -t <ms>         discard speeds older than this when they reach the avr (0 disables)\n");
+    printf("  -p <ms>         interval between round-trip time measurements (0 disables)\n");
+    printf("  -f <version>    serial framing version: 1 (default) or 2 (COBS with CRC-16)\n");
+    printf("  -l <level>      log level: none, error, warning, info (default) or debug\n");
+    printf("  -r <priority>   run the serial thread at this SCHED_FIFO priority and lock memory\n");
+    printf("  -a <cpu>        pin the serial thread to this cpu\n");
+    printf("  -w <cpu>        pin the web thread to this cpu\n");
+    printf("  -s <policy>     clients that miss debug messages: skip (default) or disconnect\n");
+    printf("  -S              service the serial port from the web thread instead of a worker thread\n");
+    printf("  -c <bytes>      combine pending debug messages into frames of up to this size (default 4096, 0 disables)\n");
+    printf("  -C <path>       record serial and websocket traffic to this file, for tools/replay\n");
+    printf("Send SIGUSR1 to print link statistics, SIGUSR2 to cycle the log level\n");
+}
+
 int main(int argc, char *argv[])
 {
+    const char *serial_port = "/dev/tty.iap";
+    uint32_t serial_baud = 115200;
+    uint32_t max_baud = 1000000;
+    double speed_epsilon = 0.005;
+    int speed_keepalive_ms = 500;
+    int speed_max_age_ms = 250;
+    int ping_interval_ms = 1000;
+    int framing_version = 1;
+    int log_start_level = LOG_LEVEL_INFO;
+    struct realtime_config serial_realtime = { .priority = 0, .cpu = -1 };
+    struct realtime_config web_realtime = { .priority = 0, .cpu = -1 };
+    enum webserver_lag_policy lag_policy = WEBSERVER_LAG_SKIP;
+    int batch_size = 4096;
+    bool single_threaded = false;
+    const char *capture_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:b:B:e:k:t:p:f:l:r:a:w:s:c:C:Sh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            serial_port = optarg;
+            break;
+        case 'b':
+            serial_baud = atoi(optarg);
+            break;
+        case 'B':
+            max_baud = atoi(optarg);
+            break;
+        case 'e':
+            speed_epsilon = atof(optarg);
+            break;
+        case 'k':
+            speed_keepalive_ms = atoi(optarg);
+            break;
+        case 't':
+            speed_max_age_ms = atoi(optarg);
+            break;
+        case 'p':
+            ping_interval_ms = atoi(optarg);
+            break;
+        case 'f':
+            framing_version = atoi(optarg);
+            if (framing_version != 1 && framing_version != 2)
+            {
+                printf("Invalid framing version: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            for (log_start_level = LOG_LEVEL_NONE; log_start_level <= LOG_LEVEL_DEBUG; log_start_level++)
+                if (!strcmp(optarg, log_level_name(log_start_level)))
+                    break;
+
+            if (log_start_level > LOG_LEVEL_DEBUG)
+            {
+                printf("Invalid log level: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            serial_realtime.priority = atoi(optarg);
+            break;
+        case 'a':
+            serial_realtime.cpu = atoi(optarg);
+            break;
+        case 'w':
+            web_realtime.cpu = atoi(optarg);
+            break;
+        case 's':
+            if (!strcmp(optarg, "skip"))
+                lag_policy = WEBSERVER_LAG_SKIP;
+            else if (!strcmp(optarg, "disconnect"))
+                lag_policy = WEBSERVER_LAG_DISCONNECT;
+            else
+            {
+                printf("Invalid lag policy: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            batch_size = atoi(optarg);
+            break;
+        case 'C':
+            capture_path = optarg;
+            break;
+        case 'S':
+            single_threaded = true;
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
     signal(SIGINT, shutdown_handler);
+    signal(SIGUSR1, stats_handler);
+    signal(SIGUSR2, log_level_handler);
 
-    avr = avr_new("/dev/tty.iap", 115200);
-    if (!avr)
+    if (!log_init(log_start_level))
     {
-        printf("Failed to initialize AVR connection\n");
+        printf("Failed to initialize logging\n");
         return 1;
     }
 
+    // Lock memory before the remaining threads and buffers are created.
+    // The capture is mapped in between so that its reservation isn't
+    // locked into RAM or counted against RLIMIT_MEMLOCK.
+    if (serial_realtime.priority > 0)
+        realtime_lock_memory();
+
+    if (capture_path)
+    {
+        capture = capture_open(capture_path, CAPTURE_DEFAULT_SIZE);
+        if (!capture)
+        {
+            printf("Failed to open capture file %s\n", capture_path);
+            log_shutdown();
+            return 1;
+        }
+    }
+
+    if (serial_realtime.priority > 0)
+        realtime_lock_future_memory();
+
     webserver = webserver_create(7681);
     if (!webserver)
     {
         printf("Failed to initialize webserver\n");
+        if (capture)
+            capture_close(capture);
+        log_shutdown();
+        return 1;
+    }
+
+    webserver_set_lag_policy(webserver, lag_policy);
+    if (batch_size > 0 && !webserver_set_batch_size(webserver, batch_size))
+    {
+        printf("Failed to allocate websocket batch buffer\n");
+        webserver_free(webserver);
+        if (capture)
+            capture_close(capture);
+        log_shutdown();
+        return 1;
+    }
+
+    if (single_threaded)
+        avr = avr_new_polled(serial_port, serial_baud, forward_debug_message, webserver);
+    else
+        avr = avr_new(serial_port, serial_baud, forward_debug_message, webserver);
+    if (!avr)
+    {
+        printf("Failed to initialize AVR connection\n");
+        webserver_free(webserver);
+        if (capture)
+            capture_close(capture);
+        log_shutdown();
         return 1;
     }
 
+    avr_set_speed_filter(avr, speed_epsilon, speed_keepalive_ms);
+    avr_set_speed_max_age(avr, speed_max_age_ms);
+    avr_set_ping_interval(avr, ping_interval_ms);
+    avr_set_framing(avr, framing_version);
+    avr_set_max_baud(avr, max_baud);
+    if (serial_realtime.priority > 0 || serial_realtime.cpu >= 0)
+        avr_set_realtime(avr, &serial_realtime);
+
+    // Pin this thread only after the avr worker has been created,
+    // so that the worker doesn't inherit its affinity
+    if (web_realtime.cpu >= 0)
+        realtime_configure_thread(&web_realtime);
+
+    if (capture)
+    {
+        webserver_set_capture(webserver, capture);
+        avr_set_capture(avr, capture);
+    }
+
+    struct pollfd serial = { .fd = -1 };
     int n = 0;
     while (n >= 0)
     {
@@ -58,12 +362,59 @@ int main(int argc, char *argv[])
             break;
         }
 
-        n = webserver_tick(webserver, 50);
+        if (stats_requested)
+        {
+            stats_requested = false;
+            print_stats();
+        }
+
+        if (log_level_requested)
+        {
+            log_level_requested = false;
+            int level = log_level == LOG_LEVEL_DEBUG ? LOG_LEVEL_NONE : log_level + 1;
+            log_set_level(level);
+            printf("Log level set to %s\n", log_level_name(level));
+        }
+
+        int timeout_ms = WEBSERVER_TICK_MS;
+        if (single_threaded)
+        {
+            // Failures are reported at the top of the loop
+            int serial_timeout_ms;
+            if (!avr_service(avr, serial.revents, &serial_timeout_ms))
+                continue;
+
+            if (serial_timeout_ms >= 0 && serial_timeout_ms < timeout_ms)
+                timeout_ms = serial_timeout_ms;
+
+            serial.fd = avr_poll_fd(avr, &serial.events);
+        }
+
+        uint64_t tick_start = timing_now_ns();
+        if (single_threaded)
+            n = webserver_tick_polled(webserver, &serial, timeout_ms);
+        else
+            n = webserver_tick(webserver, timeout_ms);
+
+        // Ticks that return early were woken by network or serial activity,
+        // or by new debug messages
+        uint64_t elapsed = timing_now_ns() - tick_start;
+        uint64_t expected = timeout_ms * 1000000ULL;
+        if (elapsed >= expected)
+            histogram_record(&web_latency, elapsed - expected);
     }
 
     webserver_free(webserver);
+    webserver = NULL;
 
+    log_shutdown();
+    print_stats();
     avr_free(avr);
+
+    // Both threads have stopped writing
+    if (capture)
+        capture_close(capture);
+
     printf("Exiting cleanly\n");
     return 0;
 }
\ No newline at end of file
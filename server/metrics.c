@@ -0,0 +1,171 @@
+//*****************************************************************************
+//  Prometheus text format rendering of server statistics
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "metrics.h"
+#include "decoder.h"
+
+#define METRICS_INITIAL_SIZE 8192
+
+// Quantiles reported for each latency histogram
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+bool metrics_init(struct metrics *metrics)
+{
+    *metrics = (struct metrics) {
+        .data = malloc(METRICS_INITIAL_SIZE),
+        .size = METRICS_INITIAL_SIZE
+    };
+
+    return metrics->data != NULL;
+}
+
+void metrics_free(struct metrics *metrics)
+{
+    free(metrics->data);
+    metrics->data = NULL;
+}
+
+// Append text, growing the buffer as needed. Once an allocation
+// fails the output is incomplete and failed is set.
+void metrics_printf(struct metrics *metrics, const char *format, ...)
+{
+    if (metrics->failed)
+        return;
+
+    for (;;)
+    {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(metrics->data + metrics->length, metrics->size - metrics->length, format, args);
+        va_end(args);
+
+        if (n < 0)
+        {
+            metrics->failed = true;
+            return;
+        }
+
+        if ((size_t)n < metrics->size - metrics->length)
+        {
+            metrics->length += n;
+            return;
+        }
+
+        char *data = realloc(metrics->data, 2 * metrics->size + n);
+        if (!data)
+        {
+            metrics->failed = true;
+            return;
+        }
+
+        metrics->data = data;
+        metrics->size = 2 * metrics->size + n;
+    }
+}
+
+void metrics_describe(struct metrics *metrics, const char *name, const char *type, const char *help)
+{
+    metrics_printf(metrics, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_counter(struct metrics *metrics, const char *name, const char *help, uint64_t value)
+{
+    metrics_describe(metrics, name, "counter", help);
+    metrics_printf(metrics, "%s %llu\n", name, (unsigned long long)value);
+}
+
+void metrics_gauge(struct metrics *metrics, const char *name, const char *help, double value)
+{
+    metrics_describe(metrics, name, "gauge", help);
+    metrics_printf(metrics, "%s %.9g\n", name, value);
+}
+
+// Report a histogram of nanosecond values as a summary in seconds
+void metrics_summary(struct metrics *metrics, const char *name, const char *help, const struct histogram *ns)
+{
+    metrics_describe(metrics, name, "summary", help);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        metrics_printf(metrics, "%s{quantile=\"%g\"} %.9g\n", name, quantiles[i],
+                       ns->count ? histogram_percentile(ns, quantiles[i]) / 1e9 : 0);
+
+    metrics_printf(metrics, "%s_sum %.9g\n%s_count %llu\n", name, ns->sum / 1e9,
+                   name, (unsigned long long)ns->count);
+}
+
+void metrics_add_avr(struct metrics *metrics, struct avr *avr)
+{
+    struct avr_telemetry telemetry;
+    avr_get_telemetry(avr, &telemetry);
+    metrics_gauge(metrics, "tankbot_serial_link_active", "Whether a valid packet has been received from the avr",
+                  telemetry.link_active);
+    metrics_gauge(metrics, "tankbot_serial_baud", "Serial line rate", telemetry.baud);
+    metrics_gauge(metrics, "tankbot_serial_framing_version", "Serial framing version", avr_get_framing(avr));
+
+    struct avr_transmit_stats transmit;
+    avr_get_transmit_stats(avr, &transmit);
+    metrics_counter(metrics, "tankbot_serial_sent_bytes_total", "Bytes written to the serial port", transmit.bytes);
+    metrics_counter(metrics, "tankbot_serial_sent_frames_total", "Frames written to the serial port", transmit.frames);
+    metrics_gauge(metrics, "tankbot_serial_queued_bytes", "Bytes waiting to be sent, including the port's output queue",
+                  transmit.queued);
+
+    struct decoder_stats receive;
+    avr_get_receive_stats(avr, &receive);
+    metrics_counter(metrics, "tankbot_serial_received_bytes_total", "Bytes read from the serial port", receive.bytes);
+    metrics_counter(metrics, "tankbot_serial_received_frames_total", "Frames decoded", receive.frames);
+    metrics_counter(metrics, "tankbot_serial_discarded_bytes_total", "Bytes skipped while searching for a frame",
+                    receive.discarded_bytes);
+    metrics_counter(metrics, "tankbot_serial_long_packets_total", "Frames longer than the largest packet",
+                    receive.long_packets);
+    metrics_counter(metrics, "tankbot_serial_checksum_failures_total", "Version 1 frames with a bad checksum",
+                    receive.checksum_failures);
+    metrics_counter(metrics, "tankbot_serial_footer_failures_total", "Version 1 frames with a bad footer",
+                    receive.footer_failures);
+    metrics_counter(metrics, "tankbot_serial_crc_failures_total", "Version 2 frames with a bad CRC",
+                    receive.crc_failures);
+    metrics_counter(metrics, "tankbot_serial_sequence_gaps_total", "Version 2 frames lost in transit",
+                    receive.sequence_gaps);
+
+    struct avr_speed_stats speed;
+    avr_get_speed_stats(avr, &speed);
+    metrics_counter(metrics, "tankbot_speeds_sent_total", "Speed packets sent to the avr", speed.sent);
+    metrics_counter(metrics, "tankbot_speeds_expired_total", "Speed packets that reached the avr after their deadline",
+                    speed.expired);
+    metrics_counter(metrics, "tankbot_speeds_overwritten_total", "Speeds replaced by a newer request before being sent",
+                    speed.overwritten);
+    metrics_counter(metrics, "tankbot_speeds_suppressed_total", "Speeds not sent because they were within the epsilon",
+                    speed.suppressed);
+    metrics_counter(metrics, "tankbot_speeds_deferred_total", "Speeds held back while earlier data was being sent",
+                    speed.deferred);
+    metrics_gauge(metrics, "tankbot_speed_deferring", "Whether a speed is being held back now", speed.deferring);
+
+    struct avr_ping_stats ping;
+    avr_get_ping_stats(avr, &ping);
+    metrics_counter(metrics, "tankbot_pings_sent_total", "Round-trip time measurements sent", ping.sent);
+    metrics_counter(metrics, "tankbot_pings_received_total", "Round-trip time measurements returned", ping.received);
+    metrics_summary(metrics, "tankbot_ping_rtt_seconds", "Serial link round-trip time", &ping.rtt);
+
+    struct histogram wakeup;
+    avr_get_wakeup_latency(avr, &wakeup);
+    metrics_summary(metrics, "tankbot_serial_wakeup_latency_seconds", "How late the serial thread wakes after a timeout",
+                    &wakeup);
+}
+
+void metrics_add_capture(struct metrics *metrics, struct capture *capture)
+{
+    struct capture_stats stats;
+    capture_get_stats(capture, &stats);
+    metrics_counter(metrics, "tankbot_capture_records_total", "Records written to the capture file", stats.records);
+    metrics_counter(metrics, "tankbot_capture_dropped_total", "Records that didn't fit in the capture file",
+                    stats.dropped);
+    metrics_gauge(metrics, "tankbot_capture_used_bytes", "Bytes used in the capture file", stats.used);
+    metrics_gauge(metrics, "tankbot_capture_size_bytes", "Space reserved for the capture file", stats.size);
+}
@@ -0,0 +1,43 @@
+//*****************************************************************************
+//  Prometheus text format rendering of server statistics
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_METRICS_H
+#define TANKBOT_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "avr.h"
+#include "capture.h"
+#include "histogram.h"
+
+// Text built up for one scrape. Counters are kept by the threads that
+// update them and only gathered here, when the page is requested.
+struct metrics
+{
+    char *data;
+    size_t length;
+    size_t size;
+    bool failed;
+};
+
+bool metrics_init(struct metrics *metrics);
+void metrics_free(struct metrics *metrics);
+
+void metrics_printf(struct metrics *metrics, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void metrics_describe(struct metrics *metrics, const char *name, const char *type, const char *help);
+void metrics_counter(struct metrics *metrics, const char *name, const char *help, uint64_t value);
+void metrics_gauge(struct metrics *metrics, const char *name, const char *help, double value);
+void metrics_summary(struct metrics *metrics, const char *name, const char *help, const struct histogram *ns);
+
+void metrics_add_avr(struct metrics *metrics, struct avr *avr);
+void metrics_add_capture(struct metrics *metrics, struct capture *capture);
+
+#endif
@@ -0,0 +1,126 @@
+//*****************************************************************************
+//  Real-time scheduling, CPU affinity and memory locking
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+#include "log.h"
+#include "realtime.h"
+
+// Stack touched by realtime_prefault_stack. This must cover the deepest
+// call chain of a configured thread, including the log formatting buffers.
+#define REALTIME_STACK_PREFAULT (64*1024)
+
+// Lock all current pages into memory so that the control
+// threads never wait on a page fault
+bool realtime_lock_memory()
+{
+    if (mlockall(MCL_CURRENT))
+    {
+        log_warning("Failed to lock memory: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Lock every page mapped after this call, without unlocking current pages.
+// Note that this includes the whole of every thread stack created later.
+bool realtime_lock_future_memory()
+{
+    if (mlockall(MCL_FUTURE))
+    {
+        log_warning("Failed to lock future memory: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Touch the top of the calling thread's stack so that its pages are
+// mapped (and locked, after realtime_lock_future_memory) before they are needed
+void realtime_prefault_stack()
+{
+    volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 1024)
+        stack[i] = 0;
+}
+
+static bool set_affinity(int cpu)
+{
+#ifdef __APPLE__
+    // Darwin only supports affinity tags, which hint that threads sharing a
+    // tag should share a cache. iOS rejects even this, so failure is expected.
+    thread_affinity_policy_data_t policy = { .affinity_tag = cpu + 1 };
+    kern_return_t ret = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                                          (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+    if (ret != KERN_SUCCESS)
+    {
+        log_warning("Failed to set affinity tag %d: error %d\n", cpu + 1, ret);
+        return false;
+    }
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (ret)
+    {
+        log_warning("Failed to pin thread to cpu %d: %s\n", cpu, strerror(ret));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+// Apply the scheduling priority and cpu affinity to the calling thread
+bool realtime_configure_thread(const struct realtime_config *config)
+{
+    bool success = true;
+    if (config->priority > 0)
+    {
+        struct sched_param param = { .sched_priority = config->priority };
+        int min = sched_get_priority_min(SCHED_FIFO);
+        int max = sched_get_priority_max(SCHED_FIFO);
+        if (param.sched_priority < min)
+            param.sched_priority = min;
+        if (param.sched_priority > max)
+            param.sched_priority = max;
+
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret)
+        {
+            log_warning("Failed to set SCHED_FIFO priority %d: %s\n", param.sched_priority, strerror(ret));
+            success = false;
+        }
+        else
+            log_info("Thread running with SCHED_FIFO priority %d\n", param.sched_priority);
+    }
+
+    if (config->cpu >= 0)
+    {
+        if (set_affinity(config->cpu))
+            log_info("Thread pinned to cpu %d\n", config->cpu);
+        else
+            success = false;
+    }
+
+    realtime_prefault_stack();
+    return success;
+}
@@ -0,0 +1,29 @@
+//*****************************************************************************
+//  Real-time scheduling, CPU affinity and memory locking
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_REALTIME_H
+#define TANKBOT_REALTIME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Settings applied to a thread. A priority of 0 leaves the thread
+// timesharing, and a cpu of -1 lets it run anywhere.
+struct realtime_config
+{
+    int priority;
+    int cpu;
+};
+
+bool realtime_lock_memory();
+bool realtime_lock_future_memory();
+bool realtime_configure_thread(const struct realtime_config *config);
+void realtime_prefault_stack();
+
+#endif
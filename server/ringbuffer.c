@@ -0,0 +1,101 @@
+//*****************************************************************************
+//  Lock-free single-producer / single-consumer byte ring
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include "ringbuffer.h"
+
+// head and tail are free-running byte counters, masked on access.
+// head is only written by the producer and tail only by the consumer,
+// so each side publishes its own counter with release semantics and
+// reads the other with acquire semantics.
+struct ringbuffer
+{
+    uint8_t *data;
+    size_t size;
+
+    size_t head;
+    size_t tail;
+};
+
+struct ringbuffer *ringbuffer_new(size_t size)
+{
+    // Size must be a power of two so that the counters can be masked
+    if (size == 0 || (size & (size - 1)))
+        return NULL;
+
+    struct ringbuffer *ring = calloc(1, sizeof(struct ringbuffer));
+    if (!ring)
+        return NULL;
+
+    ring->data = malloc(size);
+    if (!ring->data)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->size = size;
+    return ring;
+}
+
+void ringbuffer_free(struct ringbuffer *ring)
+{
+    free(ring->data);
+    free(ring);
+}
+
+// Append a complete block of data, or nothing at all if there
+// isn't enough space. Never blocks.
+bool ringbuffer_write(struct ringbuffer *ring, const uint8_t *data, size_t length)
+{
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t used = head - tail;
+
+    if (length > ring->size - used)
+        return false;
+
+    size_t offset = head & (ring->size - 1);
+    size_t first = ring->size - offset;
+    if (first > length)
+        first = length;
+
+    memcpy(&ring->data[offset], data, first);
+    memcpy(ring->data, data + first, length - first);
+    __atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+// Copy up to length bytes out of the ring and release them
+size_t ringbuffer_read(struct ringbuffer *ring, uint8_t *data, size_t length)
+{
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (length > head - tail)
+        length = head - tail;
+
+    size_t offset = tail & (ring->size - 1);
+    size_t first = ring->size - offset;
+    if (first > length)
+        first = length;
+
+    memcpy(data, &ring->data[offset], first);
+    memcpy(data + first, ring->data, length - first);
+    __atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+size_t ringbuffer_used(struct ringbuffer *ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
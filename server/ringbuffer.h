@@ -0,0 +1,30 @@
+//*****************************************************************************
+//  Lock-free single-producer / single-consumer byte ring
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_RINGBUFFER_H
+#define TANKBOT_RINGBUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ringbuffer;
+struct ringbuffer *ringbuffer_new(size_t size);
+void ringbuffer_free(struct ringbuffer *ring);
+
+// Producer side
+bool ringbuffer_write(struct ringbuffer *ring, const uint8_t *data, size_t length);
+
+// Consumer side
+size_t ringbuffer_read(struct ringbuffer *ring, uint8_t *data, size_t length);
+
+// Any thread
+size_t ringbuffer_used(struct ringbuffer *ring);
+
+#endif
@@ -17,6 +17,37 @@
 #include <termios.h>
 #include <unistd.h>
 #include "serial.h"
+#include "log.h"
+
+#if defined(__linux__)
+#include <linux/serial.h>
+
+// From <asm/termbits.h>, which can't be included alongside <termios.h>
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+#elif defined(__APPLE__)
+// From <IOKit/serial/ioss.h>, which is not part of the iOS SDK
+#ifndef IOSSIOSPEED
+#define IOSSIOSPEED _IOW('T', 2, speed_t)
+#define IOSSDATALAT _IOW('T', 0, unsigned long)
+#endif
+#endif
 
 struct serial_port
 {
@@ -34,32 +65,32 @@ struct serial_port *serial_port_open(const char *path, uint32_t baud)
     port->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (port->fd == -1)
     {
-        printf("Failed to open port: %s\n", path);
+        log_error("Failed to open port: %s\n", path);
         return NULL;
     }
 
     // Require exclusive access to the port
     if (ioctl(port->fd, TIOCEXCL) == -1)
     {
-        printf("Failed to set TIOCEXCL; errno %d (%s).\n", errno,
-               strerror(errno));
+        log_error("Failed to set TIOCEXCL; errno %d (%s).\n", errno,
+                  strerror(errno));
         goto configuration_error;
     }
 
-    // Clear O_NONBLOCK - non-blocking reads are set via non-canonical
-    // mode VMIN=VTIME=0, which gives nicer semantics than O_NONBLOCK.
-    if (fcntl(port->fd, F_SETFL, 0) == -1)
+    // Keep O_NONBLOCK so that writes return early when the output buffer
+    // is full instead of stalling the caller's poll loop.
+    if (fcntl(port->fd, F_SETFL, O_NONBLOCK) == -1)
     {
-        printf("Failed to clear O_NONBLOCK; errno %d (%s).\n", errno,
-               strerror(errno));
+        log_error("Failed to set O_NONBLOCK; errno %d (%s).\n", errno,
+                  strerror(errno));
         goto configuration_error;
     }
 
     // Get the current options to restore when we are finished.
     if (tcgetattr(port->fd, &port->initial_tio) == -1)
     {
-        printf("Failed to query port attributes; errno %d (%s).\n", errno,
-               strerror(errno));
+        log_error("Failed to query port attributes; errno %d (%s).\n", errno,
+                  strerror(errno));
         goto configuration_error;
     }
 
@@ -67,10 +98,6 @@ struct serial_port *serial_port_open(const char *path, uint32_t baud)
     struct termios tio;
     memcpy(&tio, &port->initial_tio, sizeof(struct termios));
 
-    // Set baud rate
-    cfsetispeed(&tio, baud);
-    cfsetospeed(&tio, baud);
-
     // Enable input with 8N1 frame, disabling flow control and status lines
     tio.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS);
     tio.c_cflag |= CREAD | CLOCAL | CS8;
@@ -89,17 +116,118 @@ struct serial_port *serial_port_open(const char *path, uint32_t baud)
     // Apply attributes
     if (tcsetattr(port->fd, TCSANOW, &tio) == -1)
     {
-        printf("Failed to set port attributes; errno %d (%s).\n", errno,
-               strerror(errno));
+        log_error("Failed to set port attributes; errno %d (%s).\n", errno,
+                  strerror(errno));
         goto configuration_error;
     }
 
+    if (serial_port_set_baud(port, baud))
+        goto configuration_error;
+
+    serial_port_set_low_latency(port);
     return port;
 configuration_error:
     close(port->fd);
     return NULL;
 }
 
+// Map standard rates onto termios constants
+static speed_t baud_constant(uint32_t baud)
+{
+    switch (baud)
+    {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B500000
+    case 500000: return B500000;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+    default: return 0;
+    }
+}
+
+// Change the line rate. Rates without a termios constant use
+// termios2/BOTHER on Linux and IOSSIOSPEED on iOS.
+int serial_port_set_baud(struct serial_port *port, uint32_t baud)
+{
+    speed_t speed = baud_constant(baud);
+    if (speed)
+    {
+        struct termios tio;
+        if (tcgetattr(port->fd, &tio) == -1 || cfsetispeed(&tio, speed) == -1 ||
+            cfsetospeed(&tio, speed) == -1 || tcsetattr(port->fd, TCSANOW, &tio) == -1)
+        {
+            log_error("Failed to set baud rate %u; errno %d (%s).\n", baud, errno, strerror(errno));
+            return -1;
+        }
+
+        return 0;
+    }
+
+#if defined(__linux__)
+    struct termios2 tio2;
+    if (ioctl(port->fd, TCGETS2, &tio2) == 0)
+    {
+        tio2.c_cflag &= ~CBAUD;
+        tio2.c_cflag |= BOTHER;
+        tio2.c_cflag &= ~(CBAUD << IBSHIFT);
+        tio2.c_cflag |= BOTHER << IBSHIFT;
+        tio2.c_ispeed = baud;
+        tio2.c_ospeed = baud;
+        if (ioctl(port->fd, TCSETS2, &tio2) == 0)
+            return 0;
+    }
+#elif defined(__APPLE__)
+    speed = baud;
+    if (ioctl(port->fd, IOSSIOSPEED, &speed) == 0)
+        return 0;
+#else
+    errno = EINVAL;
+#endif
+
+    log_error("Failed to set baud rate %u; errno %d (%s).\n", baud, errno, strerror(errno));
+    return -1;
+}
+
+// Ask the driver to pass received data on immediately instead of batching it.
+// Not all devices support this, so failures are not treated as errors.
+void serial_port_set_low_latency(struct serial_port *port)
+{
+#if defined(__linux__)
+    struct serial_struct serial;
+    if (ioctl(port->fd, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(port->fd, TIOCSSERIAL, &serial) == 0)
+            return;
+    }
+#elif defined(__APPLE__)
+    unsigned long latency = 1;
+    if (ioctl(port->fd, IOSSDATALAT, &latency) == 0)
+        return;
+#endif
+
+    log_debug("Low latency mode is not available on this port\n");
+}
+
+// Block until all written data has been transmitted
+int serial_port_drain(struct serial_port *port)
+{
+    return tcdrain(port->fd) == -1 ? -errno : 0;
+}
+
+// Discard data that has been received but not read
+int serial_port_flush_input(struct serial_port *port)
+{
+    return tcflush(port->fd, TCIFLUSH) == -1 ? -errno : 0;
+}
+
 void serial_port_close(struct serial_port *port)
 {
     if (port->fd == -1)
@@ -110,19 +238,38 @@ void serial_port_close(struct serial_port *port)
     close(port->fd);
 }
 
+// Reads and writes return 0 rather than an error when they would block
 ssize_t serial_port_read(struct serial_port *port, uint8_t *buf, size_t length)
 {
     ssize_t ret = read(port->fd, buf, length);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
     return (ret == -1) ? -errno : ret;
 }
 
 ssize_t serial_port_write(struct serial_port *port, const uint8_t *buf, size_t length)
 {
     ssize_t ret = write(port->fd, buf, length);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
     return (ret == -1) ? -errno : ret;
 }
 
 const char *serial_port_error_string(struct serial_port *port, ssize_t code)
 {
     return strerror(-code);
-}
\ No newline at end of file
+}
+
+int serial_port_fd(struct serial_port *port)
+{
+    return port->fd;
+}
+
+// Number of bytes written to the port that haven't yet been transmitted
+ssize_t serial_port_output_pending(struct serial_port *port)
+{
+    int pending;
+    if (ioctl(port->fd, TIOCOUTQ, &pending) == -1)
+        return -errno;
+    return pending;
+}
@@ -16,8 +16,14 @@
 struct serial_port;
 struct serial_port *serial_port_open(const char *path, uint32_t baud);
 void serial_port_close(struct serial_port *port);
+int serial_port_set_baud(struct serial_port *port, uint32_t baud);
+void serial_port_set_low_latency(struct serial_port *port);
+int serial_port_drain(struct serial_port *port);
+int serial_port_flush_input(struct serial_port *port);
 ssize_t serial_port_read(struct serial_port *port, uint8_t *buf, size_t length);
 ssize_t serial_port_write(struct serial_port *port, const uint8_t *buf, size_t length);
 const char *serial_port_error_string(struct serial_port *port, ssize_t code);
+int serial_port_fd(struct serial_port *port);
+ssize_t serial_port_output_pending(struct serial_port *port);
 
 #endif
@@ -0,0 +1,33 @@
+//*****************************************************************************
+//  Monotonic time source
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include "timing.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+
+// iOS doesn't provide clock_gettime
+uint64_t timing_now_ns()
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+#else
+#include <time.h>
+
+uint64_t timing_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
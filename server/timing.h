@@ -0,0 +1,17 @@
+//*****************************************************************************
+//  Monotonic time source
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_TIMING_H
+#define TANKBOT_TIMING_H
+
+#include <stdint.h>
+
+uint64_t timing_now_ns();
+
+#endif
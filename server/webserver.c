@@ -9,23 +9,33 @@
 //*****************************************************************************
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <getopt.h>
-#include <pthread.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/time.h>
 #include <syslog.h>
 #include "webserver.h"
+#include "asset.h"
 #include "avr.h"
+#include "histogram.h"
+#include "log.h"
+#include "metrics.h"
+#include "timing.h"
+#include "wsproto.h"
+#include "../protocol.h"
 
-#include "include/json-c/json.h"
 #include "include/libwebsockets.h"
 
 #define LOCAL_RESOURCE_PATH "/usr/share/tankbotserver"
-#define CLAMP(x, min, max) (((x) >= (max)) ? (max) : (((x) <= (min)) ? (min) : (x)))
+
+// Interval between telemetry updates sent to binary clients, in ms
+#define TELEMETRY_INTERVAL 100
 
 extern struct avr *avr;
 
@@ -38,15 +48,71 @@ static const struct serveable whitelist[] = {
     { "/test.html", "text/html" },
 };
 
+#define WHITELIST_LENGTH (sizeof(whitelist) / sizeof(whitelist[0]))
+
+// Generated on request rather than loaded from disk
+#define METRICS_PATH "/metrics"
+
 struct session {
     struct libwebsocket *wsi;
-    size_t debug_messages_head;
+
+    // Sequence number of the next debug message to send
+    uint32_t debug_messages_next;
+
+    // Messages missed since the last gap marker was sent
+    uint32_t gap;
+
+    // Messages missed, and times the socket was too full to write
+    uint64_t dropped;
+    uint64_t choked;
+
+    // Using the tankbot-binary subprotocol
+    bool binary;
+    uint32_t telemetry_sequence;
+
+    // Open sessions, for reporting per-session metrics
+    struct session *prev;
+    struct session *next;
 };
 
-// TODO: Merge this with the definition in protocol.h
-#define DEBUG_MESSAGE_MAX_LENGTH 200
+#define BINARY_PROTOCOL_NAME "tankbot-binary"
+
+// Indices into protocols[]
+enum protocol
+{
+    PROTOCOL_HTTP,
+    PROTOCOL_TANKBOT,
+    PROTOCOL_TANKBOT_BINARY
+};
+
+// Must be a power of two so that the ring index survives
+// the message sequence number wrapping
 #define DEBUG_MESSAGE_BUFFER_SIZE 128
 
+// The larger of the two encodings
+#define DEBUG_MESSAGE_FRAME_LENGTH WSPROTO_JSON_MESSAGE_LENGTH(MAX_MESSAGE_LENGTH)
+
+// A debug message encoded once for each subprotocol, stored in a slot
+// of the preallocated ring. The avr thread overwrites the oldest slot
+// without waiting for the web thread, which copies out a frame and then
+// checks that the slot was not modified while it was reading (a seqlock).
+struct debug_message
+{
+    // Odd while the slot is being written
+    uint32_t lock;
+
+    // Sequence number of the message held in this slot
+    uint32_t sequence;
+
+    // When the message was queued
+    uint64_t time;
+
+    size_t json_length;
+    size_t binary_length;
+    unsigned char json[DEBUG_MESSAGE_FRAME_LENGTH];
+    unsigned char binary[WSPROTO_MESSAGE_HEADER_LENGTH + MAX_MESSAGE_LENGTH];
+};
+
 struct webserver
 {
     struct libwebsocket_context *context;
@@ -54,10 +120,50 @@ struct webserver
     // New data available to send
     bool dirty;
 
-    // Circular buffer of debug messages
-    char *debug_messages[DEBUG_MESSAGE_BUFFER_SIZE];
-    size_t debug_messages_head;
-    pthread_mutex_t debug_messages_mutex;
+    // Circular buffer of debug messages, with a single writer.
+    // debug_messages_written is the sequence number of the next message,
+    // and is only advanced once the previous message is complete.
+    struct debug_message *debug_messages;
+    uint32_t debug_messages_written;
+    uint64_t debug_messages_skipped;
+
+    // Handling of sessions that fall behind the ring
+    enum webserver_lag_policy lag_policy;
+    uint64_t sessions_choked;
+    uint32_t sessions_disconnected;
+
+    // Open websocket sessions. Only touched by the web thread.
+    struct session *sessions;
+
+    // Records client messages, or NULL
+    struct capture *capture;
+
+    // Buffer for combining debug messages into one frame, or NULL
+    unsigned char *batch;
+    size_t batch_size;
+    uint64_t debug_batches;
+    uint64_t debug_batched_messages;
+
+    // Contents of the whitelisted files, or NULL if they couldn't be read
+    struct asset *assets[WHITELIST_LENGTH];
+
+    // Descriptors polled in place of libwebsockets' internal loop.
+    // The first entry is the wakeup pipe, and the second the caller's.
+    struct pollfd *pollfds;
+    size_t pollfd_count;
+    size_t pollfd_capacity;
+
+    // Self-pipe written when the first message is queued after a tick,
+    // so that clients are scheduled without waiting for the timeout
+    int wakeup_pipe[2];
+
+    // Time from queueing a debug message to writing it to a client
+    struct histogram delivery_latency;
+
+    // Latest link state, sent to binary clients whose sequence is behind
+    struct wsproto_telemetry telemetry;
+    uint32_t telemetry_sequence;
+    uint64_t telemetry_time;
 };
 
 static void dump_handshake_info(struct lws_tokens *lwst)
@@ -97,36 +203,186 @@ static void dump_handshake_info(struct lws_tokens *lwst)
     }
 }
 
+static struct pollfd *find_pollfd(struct webserver *webserver, int fd)
+{
+    for (size_t i = 2; i < webserver->pollfd_count; i++)
+        if (webserver->pollfds[i].fd == fd)
+            return &webserver->pollfds[i];
+
+    return NULL;
+}
+
+// Track the descriptors that libwebsockets would poll internally
+static int update_pollfds(struct webserver *webserver, enum libwebsocket_callback_reasons reason, int fd, short events)
+{
+    struct pollfd *p = find_pollfd(webserver, fd);
+    switch (reason)
+    {
+    case LWS_CALLBACK_ADD_POLL_FD:
+        if (webserver->pollfd_count == webserver->pollfd_capacity)
+        {
+            size_t capacity = 2 * webserver->pollfd_capacity;
+            struct pollfd *pollfds = realloc(webserver->pollfds, capacity * sizeof(struct pollfd));
+            if (!pollfds)
+                return 1;
+
+            webserver->pollfds = pollfds;
+            webserver->pollfd_capacity = capacity;
+        }
+
+        webserver->pollfds[webserver->pollfd_count++] = (struct pollfd) { .fd = fd, .events = events };
+        break;
+    case LWS_CALLBACK_DEL_POLL_FD:
+        // Move the last entry into the gap. It has always been serviced
+        // already, as webserver_tick_polled works backwards.
+        if (p)
+        {
+            *p = webserver->pollfds[--webserver->pollfd_count];
+            p->revents = 0;
+        }
+        break;
+    case LWS_CALLBACK_SET_MODE_POLL_FD:
+        if (p)
+            p->events |= events;
+        break;
+    case LWS_CALLBACK_CLEAR_MODE_POLL_FD:
+        if (p)
+            p->events &= ~events;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+// Render the server counters in the Prometheus text format. Each counter
+// is only written by the thread that owns it, and is gathered here.
+static bool render_metrics(struct webserver *webserver, struct metrics *metrics)
+{
+    if (!metrics_init(metrics))
+        return false;
+
+    metrics_add_avr(metrics, avr);
+    metrics_counter(metrics, "tankbot_log_dropped_total", "Log messages dropped because a log ring was full",
+                    log_dropped());
+    if (webserver->capture)
+        metrics_add_capture(metrics, webserver->capture);
+
+    struct webserver_stats stats;
+    webserver_get_stats(webserver, &stats);
+    metrics_counter(metrics, "tankbot_debug_messages_total", "Debug messages queued for clients",
+                    stats.messages_written);
+    metrics_counter(metrics, "tankbot_debug_messages_skipped_total", "Debug messages missed by lagging clients",
+                    stats.messages_skipped);
+    metrics_counter(metrics, "tankbot_debug_batches_total", "Frames containing several debug messages",
+                    stats.batches);
+    metrics_counter(metrics, "tankbot_debug_batched_messages_total", "Debug messages sent in batches",
+                    stats.batched_messages);
+    metrics_counter(metrics, "tankbot_sessions_choked_total", "Times a client socket was too full to write",
+                    stats.sessions_choked);
+    metrics_counter(metrics, "tankbot_sessions_disconnected_total", "Clients disconnected for falling behind",
+                    stats.sessions_disconnected);
+
+    struct histogram latency;
+    webserver_get_delivery_latency(webserver, &latency);
+    metrics_summary(metrics, "tankbot_debug_delivery_latency_seconds",
+                    "Time from queueing a debug message to writing it to a client", &latency);
+
+    uint32_t written = __atomic_load_n(&webserver->debug_messages_written, __ATOMIC_ACQUIRE);
+    metrics_describe(metrics, "tankbot_session_lag_messages", "gauge", "Debug messages waiting for each client");
+    for (struct session *session = webserver->sessions; session; session = session->next)
+        metrics_printf(metrics, "tankbot_session_lag_messages{session=\"%d\"} %u\n",
+                       libwebsocket_get_socket_fd(session->wsi), written - session->debug_messages_next);
+
+    metrics_describe(metrics, "tankbot_session_dropped_messages_total", "counter", "Debug messages missed by each client");
+    for (struct session *session = webserver->sessions; session; session = session->next)
+        metrics_printf(metrics, "tankbot_session_dropped_messages_total{session=\"%d\"} %llu\n",
+                       libwebsocket_get_socket_fd(session->wsi), (unsigned long long)session->dropped);
+
+    metrics_describe(metrics, "tankbot_session_choked_total", "counter", "Times each client socket was too full to write");
+    for (struct session *session = webserver->sessions; session; session = session->next)
+        metrics_printf(metrics, "tankbot_session_choked_total{session=\"%d\"} %llu\n",
+                       libwebsocket_get_socket_fd(session->wsi), (unsigned long long)session->choked);
+
+    if (metrics->failed)
+    {
+        metrics_free(metrics);
+        return false;
+    }
+
+    return true;
+}
+
 // Serve plain HTTP data
 static int callback_http(struct libwebsocket_context *context,
                          struct libwebsocket *wsi,
                          enum libwebsocket_callback_reasons reason, void *user,
                          void *in, size_t len)
 {
-    char buf[256];
+    static char not_found[] = "HTTP/1.0 404 Not Found\x0d\x0a"
+                              "Content-Length: 0\x0d\x0a\x0d\x0a";
 
     switch (reason)
     {
     case LWS_CALLBACK_HTTP:
     {
+        struct webserver *webserver = libwebsocket_context_user(context);
+
+        if (in && strcmp((const char *)in, METRICS_PATH) == 0)
+        {
+            struct metrics metrics;
+            if (!render_metrics(webserver, &metrics))
+            {
+                log_error("Failed to render metrics\n");
+                return 1;
+            }
+
+            char header[128];
+            int length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\x0d\x0a"
+                                  "Content-Type: text/plain; version=0.0.4\x0d\x0a"
+                                  "Content-Length: %zu\x0d\x0a\x0d\x0a", metrics.length);
+
+            if (libwebsocket_write(wsi, (unsigned char *)header, length, LWS_WRITE_HTTP) < 0 ||
+                libwebsocket_write(wsi, (unsigned char *)metrics.data, metrics.length, LWS_WRITE_HTTP) < 0)
+                lwsl_err("Failed to send HTTP response\n");
+
+            metrics_free(&metrics);
+            return 1;
+        }
+
+        // Unknown paths are given the last file
         size_t n = 0;
-        size_t size = (sizeof(whitelist) / sizeof(whitelist[0]) - 1);
-        for (; n < size; n++)
+        for (; n < WHITELIST_LENGTH - 1; n++)
             if (in && strcmp((const char *)in, whitelist[n].urlpath) == 0)
                 break;
 
-        sprintf(buf, LOCAL_RESOURCE_PATH"%s", whitelist[n].urlpath);
-        printf("serving: %s\n", buf);
+        struct asset *asset = webserver->assets[n];
+        if (!asset)
+        {
+            libwebsocket_write(wsi, (unsigned char *)not_found, sizeof(not_found) - 1, LWS_WRITE_HTTP);
+            return 1;
+        }
+
+        // This version of libwebsockets doesn't expose the Accept-Encoding
+        // or If-None-Match headers. Every browser that can open the control
+        // websocket accepts gzip, and the cache lifetime stands in for
+        // conditional requests.
+        size_t length;
+        const unsigned char *response = asset_response(asset, true, &length);
+        log_info("serving: %s (%zu bytes)\n", whitelist[n].urlpath, asset_size(asset, true));
 
-        if (libwebsockets_serve_http_file(context, wsi, buf, whitelist[n].mimetype))
-            lwsl_err("Failed to send HTTP file\n");
+        if (libwebsocket_write(wsi, (unsigned char *)response, length, LWS_WRITE_HTTP) < 0)
+            lwsl_err("Failed to send HTTP response\n");
 
-        // File is sent asynchronously
-        break;
-    }
-    case LWS_CALLBACK_HTTP_FILE_COMPLETION:
-        // Kill the connection after send completes
+        // Close the connection once the response is sent
         return 1;
+    }
+    case LWS_CALLBACK_ADD_POLL_FD:
+    case LWS_CALLBACK_DEL_POLL_FD:
+    case LWS_CALLBACK_SET_MODE_POLL_FD:
+    case LWS_CALLBACK_CLEAR_MODE_POLL_FD:
+        return update_pollfds(libwebsocket_context_user(context), reason, (int)(long)user, len);
     default:
         break;
     }
@@ -134,6 +390,248 @@ static int callback_http(struct libwebsocket_context *context,
     return 0;
 }
 
+enum debug_read_result
+{
+    DEBUG_READ_OK,
+
+    // The writer holds the slot, so the message may not be gone yet
+    DEBUG_READ_BUSY,
+
+    // The message has been (or is being) replaced by a newer one
+    DEBUG_READ_OVERWRITTEN
+};
+
+// Copy the frame for message sequence into out if it fits in size,
+// setting length to its length, or 0 if it doesn't fit, and time to when
+// it was queued.
+static enum debug_read_result debug_message_read(struct webserver *webserver, uint32_t sequence, bool binary,
+                                                 unsigned char *out, size_t size, size_t *length, uint64_t *time)
+{
+    struct debug_message *m = &webserver->debug_messages[sequence % DEBUG_MESSAGE_BUFFER_SIZE];
+    uint32_t lock = __atomic_load_n(&m->lock, __ATOMIC_ACQUIRE);
+    if (lock & 1)
+        return DEBUG_READ_BUSY;
+
+    // The writer may change the slot under us, so the lengths must be
+    // bounded before they are used and the copy discarded if it happened
+    size_t l = binary ? m->binary_length : m->json_length;
+    if (l > (binary ? sizeof(m->binary) : sizeof(m->json)) || l > size)
+        l = 0;
+
+    memcpy(out, binary ? m->binary : m->json, l);
+    bool valid = m->sequence == sequence;
+    uint64_t t = m->time;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!valid || __atomic_load_n(&m->lock, __ATOMIC_RELAXED) != lock)
+        return DEBUG_READ_OVERWRITTEN;
+
+    *length = l;
+    *time = t;
+    return DEBUG_READ_OK;
+}
+
+static int write_telemetry(struct libwebsocket *wsi, const struct wsproto_telemetry *telemetry)
+{
+    unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + sizeof(struct wsproto_telemetry) + LWS_SEND_BUFFER_POST_PADDING];
+    unsigned char *data = &buf[LWS_SEND_BUFFER_PRE_PADDING];
+    memcpy(data, telemetry, sizeof(struct wsproto_telemetry));
+    return libwebsocket_write(wsi, data, sizeof(struct wsproto_telemetry), LWS_WRITE_BINARY);
+}
+
+// Count messages that a session will never receive
+static void session_drop(struct webserver *webserver, struct session *session, uint32_t count)
+{
+    session->gap += count;
+    session->dropped += count;
+    __atomic_add_fetch(&webserver->debug_messages_skipped, count, __ATOMIC_RELAXED);
+}
+
+// Reload the message count after finding a session's next message
+// overwritten. The writer publishes the count after releasing the slot,
+// so if the count doesn't show the overwrite yet, treat it as busy.
+static void reload_written(struct webserver *webserver, struct session *session, uint32_t *written, bool *busy)
+{
+    *written = __atomic_load_n(&webserver->debug_messages_written, __ATOMIC_ACQUIRE);
+    if (*written - session->debug_messages_next <= DEBUG_MESSAGE_BUFFER_SIZE)
+        *busy = true;
+}
+
+// Send the next debug message or gap marker as its own frame.
+// Sets busy if the message is still being written.
+static int write_debug_message(struct libwebsocket *wsi, struct webserver *webserver, struct session *session,
+                               uint32_t *written, bool *busy)
+{
+    unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + DEBUG_MESSAGE_FRAME_LENGTH + LWS_SEND_BUFFER_POST_PADDING];
+    unsigned char *data = &buf[LWS_SEND_BUFFER_PRE_PADDING];
+
+    size_t length;
+    uint64_t queued = 0;
+    if (session->gap)
+    {
+        length = session->binary ?
+            wsproto_encode_binary_gap(data, DEBUG_MESSAGE_FRAME_LENGTH, session->gap) :
+            wsproto_encode_json_gap((char *)data, DEBUG_MESSAGE_FRAME_LENGTH, session->gap);
+        session->gap = 0;
+    }
+    else
+    {
+        enum debug_read_result result = debug_message_read(webserver, session->debug_messages_next, session->binary,
+                                                           data, DEBUG_MESSAGE_FRAME_LENGTH, &length, &queued);
+        if (result == DEBUG_READ_BUSY)
+        {
+            *busy = true;
+            return 0;
+        }
+
+        if (result == DEBUG_READ_OVERWRITTEN)
+        {
+            reload_written(webserver, session, written, busy);
+            return 0;
+        }
+
+        if (session->binary)
+            log_debug("Sending message: %.*s\n", (int)(length - WSPROTO_MESSAGE_HEADER_LENGTH),
+                      &data[WSPROTO_MESSAGE_HEADER_LENGTH]);
+        else
+            log_debug("Sending message: %.*s\n", (int)length, data);
+
+        session->debug_messages_next++;
+    }
+
+    int n = libwebsocket_write(wsi, data, length, session->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+    if (n >= 0 && queued)
+        histogram_record(&webserver->delivery_latency, timing_now_ns() - queued);
+
+    return n;
+}
+
+// Send as many pending debug messages as fit in one batch frame.
+// Sets busy if the next message is still being written.
+static int write_debug_batch(struct libwebsocket *wsi, struct webserver *webserver, struct session *session,
+                             uint32_t *written, bool *busy)
+{
+    struct wsproto_batch batch;
+    wsproto_batch_init(&batch, webserver->batch, webserver->batch_size, session->binary);
+
+    // When each batched message was queued
+    uint64_t queued[DEBUG_MESSAGE_BUFFER_SIZE];
+    size_t queued_count = 0;
+
+    uint8_t *out;
+    size_t size;
+    if (session->gap && (out = wsproto_batch_next(&batch, &size)))
+    {
+        wsproto_batch_commit(&batch, session->binary ?
+            wsproto_encode_binary_gap(out, size, session->gap) :
+            wsproto_encode_json_gap((char *)out, size, session->gap));
+        session->gap = 0;
+    }
+
+    while (session->debug_messages_next != *written && queued_count < DEBUG_MESSAGE_BUFFER_SIZE &&
+           (out = wsproto_batch_next(&batch, &size)))
+    {
+        size_t length;
+        enum debug_read_result result = debug_message_read(webserver, session->debug_messages_next, session->binary,
+                                                           out, size, &length, &queued[queued_count]);
+        if (result == DEBUG_READ_BUSY)
+        {
+            *busy = true;
+            break;
+        }
+
+        if (result == DEBUG_READ_OVERWRITTEN)
+        {
+            // Send what we have, and leave the lag handling to the caller
+            reload_written(webserver, session, written, busy);
+            break;
+        }
+
+        if (!length)
+            break;
+
+        wsproto_batch_commit(&batch, length);
+        session->debug_messages_next++;
+        queued_count++;
+    }
+
+    if (!batch.count)
+        return 0;
+
+    log_debug("Sending batch of %zu messages\n", batch.count);
+    __atomic_add_fetch(&webserver->debug_batches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&webserver->debug_batched_messages, batch.count, __ATOMIC_RELAXED);
+
+    size_t length = wsproto_batch_finish(&batch);
+    int n = libwebsocket_write(wsi, webserver->batch, length, session->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+    if (n >= 0)
+    {
+        uint64_t now = timing_now_ns();
+        for (size_t i = 0; i < queued_count; i++)
+            histogram_record(&webserver->delivery_latency, now - queued[i]);
+    }
+
+    return n;
+}
+
+// Send queued debug messages until the session is up to date or its
+// socket is full, so that one slow client can't hold up the others
+static int write_debug_messages(struct libwebsocket_context *context, struct libwebsocket *wsi,
+                                struct webserver *webserver, struct session *session)
+{
+    uint32_t written = __atomic_load_n(&webserver->debug_messages_written, __ATOMIC_ACQUIRE);
+    while (session->gap || session->debug_messages_next != written)
+    {
+        // The messages we need have been overwritten
+        uint32_t behind = written - session->debug_messages_next;
+        if (behind > DEBUG_MESSAGE_BUFFER_SIZE)
+        {
+            if (webserver->lag_policy == WEBSERVER_LAG_DISCONNECT)
+            {
+                log_warning("Disconnecting session %d: %u messages behind\n",
+                            libwebsocket_get_socket_fd(wsi), behind);
+                __atomic_add_fetch(&webserver->sessions_disconnected, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+
+            // Resume from the newest message
+            session_drop(webserver, session, behind - 1);
+            session->debug_messages_next = written - 1;
+            behind = 1;
+        }
+
+        if (lws_send_pipe_choked(wsi))
+        {
+            session->choked++;
+            __atomic_add_fetch(&webserver->sessions_choked, 1, __ATOMIC_RELAXED);
+            libwebsocket_callback_on_writable(context, wsi);
+            return 0;
+        }
+
+        // Combine messages into one frame when more than one is waiting
+        bool busy = false;
+        int n = webserver->batch && behind + (session->gap ? 1 : 0) > 1 ?
+            write_debug_batch(wsi, webserver, session, &written, &busy) :
+            write_debug_message(wsi, webserver, session, &written, &busy);
+
+        if (n < 0)
+        {
+            lwsl_err("ERROR %d writing to socket\n", n);
+            return n;
+        }
+
+        // Don't spin while the avr thread finishes writing the slot,
+        // as it may be waiting for this thread to give up the cpu
+        if (busy)
+        {
+            libwebsocket_callback_on_writable(context, wsi);
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
 static int callback_tankbot(struct libwebsocket_context *context,
                             struct libwebsocket *wsi,
                             enum libwebsocket_callback_reasons reason,
@@ -145,87 +643,75 @@ static int callback_tankbot(struct libwebsocket_context *context,
     switch (reason)
     {
     case LWS_CALLBACK_ESTABLISHED:
-        session->debug_messages_head = webserver->debug_messages_head;
+        session->debug_messages_next = __atomic_load_n(&webserver->debug_messages_written, __ATOMIC_ACQUIRE);
+        session->binary = !strcmp(libwebsockets_get_protocol(wsi)->name, BINARY_PROTOCOL_NAME);
+        session->telemetry_sequence = webserver->telemetry_sequence - 1;
+        session->wsi = wsi;
+        session->prev = NULL;
+        session->next = webserver->sessions;
+        if (webserver->sessions)
+            webserver->sessions->prev = session;
+        webserver->sessions = session;
+
+        if (webserver->capture)
+            capture_write(webserver->capture, CAPTURE_WEBSOCKET_OPEN, session->binary ? CAPTURE_FLAG_BINARY : 0,
+                          libwebsocket_get_socket_fd(wsi), NULL, 0);
         break;
 
     case LWS_CALLBACK_SERVER_WRITEABLE:
-        // TODO: Reduce the scope of this lock
-        pthread_mutex_lock(&webserver->debug_messages_mutex);
-        while (session->debug_messages_head != webserver->debug_messages_head)
+        if (write_debug_messages(context, wsi, webserver, session) < 0)
+            return 1;
+
+        if (session->binary && session->telemetry_sequence != webserver->telemetry_sequence &&
+            !lws_send_pipe_choked(wsi))
         {
-            // JSON framing plus NULL add 30 bytes to the message length
-            const size_t buf_start = LWS_SEND_BUFFER_PRE_PADDING;
-            const size_t buf_length = LWS_SEND_BUFFER_PRE_PADDING + LWS_SEND_BUFFER_POST_PADDING + 
-                                      DEBUG_MESSAGE_MAX_LENGTH + 30;
-            char buf[buf_length];
-            char *data = &buf[buf_start];
-
-            // Construct debug message packet
-            json_object *obj = json_object_new_object();
-            json_object_object_add(obj, "type", json_object_new_string("m"));
-            json_object_object_add(obj, "value", json_object_new_string(webserver->debug_messages[session->debug_messages_head]));
-
-            int n = snprintf(data, buf_length - buf_start, json_object_to_json_string(obj),
-                webserver->debug_messages[session->debug_messages_head]);
-            json_object_put(obj);
-
-            printf("Sending message: %s\n", (char *)data);
-
-            n = libwebsocket_write(wsi, (unsigned char *)data, n, LWS_WRITE_TEXT);
-            if (n < 0) {
+            int n = write_telemetry(wsi, &webserver->telemetry);
+            if (n < 0)
+            {
                 lwsl_err("ERROR %d writing to socket\n", n);
                 return 1;
             }
 
-            if (++session->debug_messages_head == DEBUG_MESSAGE_BUFFER_SIZE)
-                session->debug_messages_head = 0;
+            session->telemetry_sequence = webserver->telemetry_sequence;
         }
-        pthread_mutex_unlock(&webserver->debug_messages_mutex);
 
         break;
 
+    case LWS_CALLBACK_CLOSED:
+        if (session->dropped || session->choked)
+            log_info("Session %d closed: %llu messages dropped, socket full %llu times\n",
+                     libwebsocket_get_socket_fd(wsi), (unsigned long long)session->dropped,
+                     (unsigned long long)session->choked);
+
+        if (session->prev)
+            session->prev->next = session->next;
+        else
+            webserver->sessions = session->next;
+        if (session->next)
+            session->next->prev = session->prev;
+
+        if (webserver->capture)
+            capture_write(webserver->capture, CAPTURE_WEBSOCKET_CLOSE, session->binary ? CAPTURE_FLAG_BINARY : 0,
+                          libwebsocket_get_socket_fd(wsi), NULL, 0);
+        break;
+
     case LWS_CALLBACK_RECEIVE:
     {
-        enum json_tokener_error err;
-    	json_object *obj = json_tokener_parse_verbose((char *)in, &err);
+        if (webserver->capture)
+            capture_write(webserver->capture, CAPTURE_WEBSOCKET_RECEIVE, session->binary ? CAPTURE_FLAG_BINARY : 0,
+                          libwebsocket_get_socket_fd(wsi), in, len);
 
-        if (err)
-        {
-            printf("JSON parse error: %s\n", json_tokener_error_desc(err));
-            break;
-        }
-
-        json_object *type_obj;
-        if (!json_object_object_get_ex(obj, "type", &type_obj))
-        {
-            printf("Invalid JSON message\n");
-            break;
-        }
+        struct wsproto_command command;
+        bool valid = session->binary ?
+            wsproto_parse_binary((const uint8_t *)in, len, &command) :
+            wsproto_parse_json((const char *)in, len, &command);
 
-        switch (json_object_get_string(type_obj)[0])
+        if (valid && command.type == WSPROTO_SPEED)
         {
-            case 'S':
-            {
-                json_object *left_obj, *right_obj;
-                if (!json_object_object_get_ex(obj, "left", &left_obj) ||
-                    !json_object_object_get_ex(obj, "right", &right_obj))
-                {
-                    printf("Invalid JSON message\n");
-                    break;
-                }
-
-                double left = CLAMP(json_object_get_double(left_obj), -1, 1);
-                double right = CLAMP(json_object_get_double(right_obj), -1, 1);
-
-                printf("Got speeds %f %f\n", left, right);
-                avr_set_speed(avr, left, right);
-
-                break;
-            }
+            log_debug("Got speeds %f %f\n", command.left, command.right);
+            avr_set_speed(avr, command.left, command.right);
         }
 
-        json_object_put(obj);
-
         break;
     }
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
@@ -242,6 +728,7 @@ static int callback_tankbot(struct libwebsocket_context *context,
 static struct libwebsocket_protocols protocols[] = {
     {"http-only", callback_http, 0},
     {"tankbot", callback_tankbot, sizeof(struct session)},
+    {BINARY_PROTOCOL_NAME, callback_tankbot, sizeof(struct session)},
     {NULL, NULL, 0}
 };
 
@@ -254,7 +741,31 @@ struct webserver *webserver_create(int port)
     int syslog_options = LOG_PID | LOG_PERROR;
     int debug_level = 7;
 
-    pthread_mutex_init(&webserver->debug_messages_mutex, NULL);
+    webserver->debug_messages = calloc(DEBUG_MESSAGE_BUFFER_SIZE, sizeof(struct debug_message));
+    webserver->pollfd_capacity = 16;
+    webserver->pollfd_count = 2;
+    webserver->pollfds = calloc(webserver->pollfd_capacity, sizeof(struct pollfd));
+    if (!webserver->debug_messages || !webserver->pollfds || pipe(webserver->wakeup_pipe) == -1)
+    {
+        log_error("Failed to allocate webserver buffers\n");
+        free(webserver->debug_messages);
+        free(webserver->pollfds);
+        free(webserver);
+        return NULL;
+    }
+
+    // Writes must never block the avr thread
+    fcntl(webserver->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(webserver->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+    webserver->pollfds[0] = (struct pollfd) { .fd = webserver->wakeup_pipe[0], .events = POLLIN };
+
+    // Load the files served over HTTP, so that requests don't touch the disk
+    for (size_t i = 0; i < WHITELIST_LENGTH; i++)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), LOCAL_RESOURCE_PATH"%s", whitelist[i].urlpath);
+        webserver->assets[i] = asset_load(path, whitelist[i].mimetype);
+    }
 
     // Set websocket logging options
     setlogmask(LOG_UPTO (LOG_DEBUG));
@@ -266,6 +777,13 @@ struct webserver *webserver_create(int port)
     if (!webserver->context)
     {
         lwsl_err("libwebsocket init failed\n");
+        for (size_t i = 0; i < WHITELIST_LENGTH; i++)
+            if (webserver->assets[i])
+                asset_free(webserver->assets[i]);
+        close(webserver->wakeup_pipe[0]);
+        close(webserver->wakeup_pipe[1]);
+        free(webserver->debug_messages);
+        free(webserver->pollfds);
         free(webserver);
         return NULL;
     }
@@ -276,32 +794,191 @@ struct webserver *webserver_create(int port)
 void webserver_free(struct webserver *webserver)
 {
     libwebsocket_context_destroy(webserver->context);
+    close(webserver->wakeup_pipe[0]);
+    close(webserver->wakeup_pipe[1]);
+    free(webserver->debug_messages);
+    free(webserver->pollfds);
+    for (size_t i = 0; i < WHITELIST_LENGTH; i++)
+        if (webserver->assets[i])
+            asset_free(webserver->assets[i]);
+    if (webserver->batch)
+        free(webserver->batch - LWS_SEND_BUFFER_PRE_PADDING);
 
     closelog();
     free(webserver);
 }
 
+// Take a new telemetry snapshot if one is due
+static bool update_telemetry(struct webserver *webserver)
+{
+    uint64_t now = timing_now_ns();
+    if (now - webserver->telemetry_time < TELEMETRY_INTERVAL * 1000000ULL)
+        return false;
+
+    struct avr_telemetry telemetry;
+    avr_get_telemetry(avr, &telemetry);
+
+    webserver->telemetry = (struct wsproto_telemetry) {
+        .type = WSPROTO_TELEMETRY,
+        .flags = telemetry.link_active ? WSPROTO_TELEMETRY_LINK_ACTIVE : 0,
+        .left = telemetry.speed_valid ? telemetry.left : 0,
+        .right = telemetry.speed_valid ? telemetry.right : 0,
+        .rtt_us = telemetry.rtt_us,
+        .baud = telemetry.baud
+    };
+
+    webserver->telemetry_sequence++;
+    webserver->telemetry_time = now;
+    return true;
+}
+
+// Ask sessions with data to send to be serviced, and return the
+// timeout to use for the next poll
+static int prepare_tick(struct webserver *webserver, int timeout_ms)
+{
+    bool dirty = __atomic_exchange_n(&webserver->dirty, false, __ATOMIC_ACQUIRE);
+    bool telemetry = update_telemetry(webserver);
+
+    if (dirty)
+        libwebsocket_callback_on_writable_all_protocol(&protocols[PROTOCOL_TANKBOT]);
+    if (dirty || telemetry)
+        libwebsocket_callback_on_writable_all_protocol(&protocols[PROTOCOL_TANKBOT_BINARY]);
+
+    if (timeout_ms < 0 || timeout_ms > TELEMETRY_INTERVAL)
+        timeout_ms = TELEMETRY_INTERVAL;
+
+    return timeout_ms;
+}
+
 int webserver_tick(struct webserver *webserver, int timeout_ms)
 {
-    if (webserver->dirty)
+    struct pollfd none = { .fd = -1 };
+    return webserver_tick_polled(webserver, &none, timeout_ms);
+}
+
+// Poll the webserver's sockets and wakeup pipe together with the caller's
+// descriptor, servicing those that are ready, so that the caller can run
+// a single event loop. The caller's revents are returned in extra, which
+// is ignored if its descriptor is negative.
+int webserver_tick_polled(struct webserver *webserver, struct pollfd *extra, int timeout_ms)
+{
+    timeout_ms = prepare_tick(webserver, timeout_ms);
+
+    webserver->pollfds[1] = *extra;
+    int n = poll(webserver->pollfds, webserver->pollfd_count, timeout_ms);
+    if (n < 0)
+    {
+        extra->revents = 0;
+        return errno == EINTR ? 0 : -1;
+    }
+
+    extra->revents = webserver->pollfds[1].revents;
+
+    // Schedule clients for the new messages straight away. They are
+    // written as soon as their sockets are ready, on the next poll.
+    if (webserver->pollfds[0].revents & POLLIN)
     {
-        webserver->dirty = false;
-        libwebsocket_callback_on_writable_all_protocol(&protocols[1]);
+        uint8_t discard[64];
+        while (read(webserver->wakeup_pipe[0], discard, sizeof(discard)) > 0);
+        prepare_tick(webserver, timeout_ms);
     }
-    return libwebsocket_service(webserver->context, timeout_ms);
+
+    // Servicing a socket may add or remove entries, which
+    // update_pollfds handles by moving the last entry
+    for (size_t i = webserver->pollfd_count; i-- > 2;)
+        if (webserver->pollfds[i].revents && libwebsocket_service_fd(webserver->context, &webserver->pollfds[i]) < 0)
+            return -1;
+
+    // Let libwebsockets check for timed out connections
+    return libwebsocket_service_fd(webserver->context, NULL);
 }
 
+// Queue a debug message for all clients. It is encoded once here,
+// rather than by every session that sends it. Must only be called
+// from one thread, which never waits for the web thread.
 void webserver_send_debug(struct webserver *webserver, const char *message, size_t length)
 {
-    pthread_mutex_lock(&webserver->debug_messages_mutex);
-    if (webserver->debug_messages[webserver->debug_messages_head])
-        free(webserver->debug_messages[webserver->debug_messages_head]);
+    uint32_t sequence = webserver->debug_messages_written;
+    struct debug_message *m = &webserver->debug_messages[sequence % DEBUG_MESSAGE_BUFFER_SIZE];
+
+    if (length > MAX_MESSAGE_LENGTH)
+        length = MAX_MESSAGE_LENGTH;
+
+    __atomic_store_n(&m->lock, m->lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    m->sequence = sequence;
+    m->time = timing_now_ns();
+    m->json_length = wsproto_encode_json_message((char *)m->json, sizeof(m->json), message, length);
+    m->binary_length = wsproto_encode_binary_message(m->binary, sizeof(m->binary), message, length);
+
+    __atomic_store_n(&m->lock, m->lock + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&webserver->debug_messages_written, sequence + 1, __ATOMIC_RELEASE);
+
+    // Only the first message since the web thread last looked needs to
+    // wake it. A full pipe already guarantees a wakeup.
+    if (!__atomic_exchange_n(&webserver->dirty, true, __ATOMIC_ACQ_REL))
+    {
+        uint8_t b = 0;
+        ssize_t ret = write(webserver->wakeup_pipe[1], &b, 1);
+        (void)ret;
+    }
+}
 
-    webserver->debug_messages[webserver->debug_messages_head] = strndup(message, length);
+void webserver_set_lag_policy(struct webserver *webserver, enum webserver_lag_policy policy)
+{
+    webserver->lag_policy = policy;
+}
 
-    if (++webserver->debug_messages_head == DEBUG_MESSAGE_BUFFER_SIZE)
-        webserver->debug_messages_head = 0;
+// Combine pending debug messages into frames of up to size bytes,
+// or send each message in its own frame if size is 0
+bool webserver_set_batch_size(struct webserver *webserver, size_t size)
+{
+    // Every message must fit in a batch on its own
+    if (size && size < DEBUG_MESSAGE_FRAME_LENGTH + WSPROTO_BATCH_OVERHEAD(2))
+        size = DEBUG_MESSAGE_FRAME_LENGTH + WSPROTO_BATCH_OVERHEAD(2);
 
-    webserver->dirty = true;
-    pthread_mutex_unlock(&webserver->debug_messages_mutex);
+    unsigned char *batch = NULL;
+    if (size)
+    {
+        batch = malloc(LWS_SEND_BUFFER_PRE_PADDING + size + LWS_SEND_BUFFER_POST_PADDING);
+        if (!batch)
+            return false;
+
+        batch += LWS_SEND_BUFFER_PRE_PADDING;
+    }
+
+    if (webserver->batch)
+        free(webserver->batch - LWS_SEND_BUFFER_PRE_PADDING);
+
+    webserver->batch = batch;
+    webserver->batch_size = size;
+    return true;
+}
+
+// Record client messages to capture, or stop recording if NULL.
+// Only call from the thread that calls webserver_tick.
+void webserver_set_capture(struct webserver *webserver, struct capture *capture)
+{
+    webserver->capture = capture;
+}
+
+// Time from webserver_send_debug to writing the message to each client.
+// Only call from the thread that calls webserver_tick.
+void webserver_get_delivery_latency(struct webserver *webserver, struct histogram *latency)
+{
+    histogram_snapshot(&webserver->delivery_latency, latency);
+}
+
+void webserver_get_stats(struct webserver *webserver, struct webserver_stats *stats)
+{
+    stats->ring_bytes = DEBUG_MESSAGE_BUFFER_SIZE * sizeof(struct debug_message);
+    stats->ring_slots = DEBUG_MESSAGE_BUFFER_SIZE;
+    stats->ring_slot_size = sizeof(struct debug_message);
+    stats->messages_written = __atomic_load_n(&webserver->debug_messages_written, __ATOMIC_RELAXED);
+    stats->messages_skipped = __atomic_load_n(&webserver->debug_messages_skipped, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&webserver->debug_batches, __ATOMIC_RELAXED);
+    stats->batched_messages = __atomic_load_n(&webserver->debug_batched_messages, __ATOMIC_RELAXED);
+    stats->sessions_choked = __atomic_load_n(&webserver->sessions_choked, __ATOMIC_RELAXED);
+    stats->sessions_disconnected = __atomic_load_n(&webserver->sessions_disconnected, __ATOMIC_RELAXED);
 }
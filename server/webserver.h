@@ -10,12 +10,57 @@
 #ifndef TANKBOT_WEBSERVER_H
 #define TANKBOT_WEBSERVER_H
 
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "capture.h"
+#include "histogram.h"
+
+// What to do with a session that falls so far behind that the
+// debug messages it has not yet been sent are overwritten
+enum webserver_lag_policy
+{
+    // Send a gap marker and resume from the newest message
+    WEBSERVER_LAG_SKIP,
+
+    // Close the connection
+    WEBSERVER_LAG_DISCONNECT
+};
+
+struct webserver_stats
+{
+    // Preallocated ring of debug messages
+    size_t ring_bytes;
+    size_t ring_slots;
+    size_t ring_slot_size;
+
+    // Messages queued, and messages overwritten before a session sent them
+    uint32_t messages_written;
+    uint64_t messages_skipped;
+
+    // Frames that combined several messages, and the messages they held
+    uint64_t batches;
+    uint64_t batched_messages;
+
+    // Times a session's socket was too full to write,
+    // and sessions closed for falling behind
+    uint64_t sessions_choked;
+    uint32_t sessions_disconnected;
+};
+
 struct webserver;
 
 struct webserver *webserver_create(int port);
 void webserver_free(struct webserver *webserver);
 int webserver_tick(struct webserver *webserver, int timeout_ms);
+int webserver_tick_polled(struct webserver *webserver, struct pollfd *extra, int timeout_ms);
 void webserver_send_debug(struct webserver *webserver, const char *message, size_t length);
+void webserver_set_lag_policy(struct webserver *webserver, enum webserver_lag_policy policy);
+bool webserver_set_batch_size(struct webserver *webserver, size_t size);
+void webserver_set_capture(struct webserver *webserver, struct capture *capture);
+void webserver_get_delivery_latency(struct webserver *webserver, struct histogram *latency);
+void webserver_get_stats(struct webserver *webserver, struct webserver_stats *stats);
 
 #endif
 
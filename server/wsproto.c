@@ -0,0 +1,394 @@
+//*****************************************************************************
+//  Messages exchanged with websocket clients
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "wsproto.h"
+
+#include "include/json-c/json.h"
+
+#define CLAMP(x, min, max) (((x) >= (max)) ? (max) : (((x) <= (min)) ? (min) : (x)))
+
+// Cursor over a text frame for the fast path parser
+struct scanner
+{
+    const char *next;
+    const char *end;
+};
+
+static void skip_whitespace(struct scanner *s)
+{
+    while (s->next < s->end && (*s->next == ' ' || *s->next == '\t' || *s->next == '\n' || *s->next == '\r'))
+        s->next++;
+}
+
+// Consume c (after any whitespace) if it is next
+static bool accept(struct scanner *s, char c)
+{
+    skip_whitespace(s);
+    if (s->next == s->end || *s->next != c)
+        return false;
+
+    s->next++;
+    return true;
+}
+
+// Consume a string without escapes, returning its contents
+static bool scan_string(struct scanner *s, const char **value, size_t *length)
+{
+    if (!accept(s, '"'))
+        return false;
+
+    const char *start = s->next;
+    while (s->next < s->end && *s->next != '"')
+    {
+        if (*s->next == '\\')
+            return false;
+        s->next++;
+    }
+
+    if (s->next == s->end)
+        return false;
+
+    *value = start;
+    *length = s->next++ - start;
+    return true;
+}
+
+// Exactly representable powers of ten
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Consume a JSON number. Numbers with more significant digits or larger
+// exponents than can be converted exactly are left to json-c.
+static bool scan_number(struct scanner *s, double *value)
+{
+    skip_whitespace(s);
+
+    bool negative = s->next < s->end && *s->next == '-';
+    if (negative)
+        s->next++;
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+
+    const char *start = s->next;
+    while (s->next < s->end && *s->next >= '0' && *s->next <= '9')
+    {
+        mantissa = 10 * mantissa + (*s->next++ - '0');
+        if (mantissa)
+            digits++;
+    }
+
+    // JSON forbids leading zeros
+    if (s->next == start || (*start == '0' && s->next - start > 1))
+        return false;
+
+    if (s->next < s->end && *s->next == '.')
+    {
+        start = ++s->next;
+        while (s->next < s->end && *s->next >= '0' && *s->next <= '9')
+        {
+            mantissa = 10 * mantissa + (*s->next++ - '0');
+            if (mantissa)
+                digits++;
+            exponent--;
+        }
+
+        if (s->next == start)
+            return false;
+    }
+
+    if (s->next < s->end && (*s->next == 'e' || *s->next == 'E'))
+    {
+        s->next++;
+        bool negative_exponent = s->next < s->end && *s->next == '-';
+        if (s->next < s->end && (*s->next == '-' || *s->next == '+'))
+            s->next++;
+
+        int e = 0;
+        start = s->next;
+        while (s->next < s->end && *s->next >= '0' && *s->next <= '9' && e < 1000)
+            e = 10 * e + (*s->next++ - '0');
+
+        if (s->next == start)
+            return false;
+
+        exponent += negative_exponent ? -e : e;
+    }
+
+    // Doubles hold 15 significant decimal digits exactly
+    if (digits > 15 || exponent > 22 || exponent < -22)
+        return false;
+
+    double v = (double)mantissa;
+    v = exponent < 0 ? v / powers_of_ten[-exponent] : v * powers_of_ten[exponent];
+    *value = negative ? -v : v;
+    return true;
+}
+
+// Parse {"type":"S","left":x,"right":y} with the keys in any order,
+// without allocating. Returns false for anything else, including valid
+// JSON that needs the general parser.
+static bool parse_json_speed(const char *in, size_t length, struct wsproto_command *command)
+{
+    struct scanner s = { in, in + length };
+    bool have_type = false, have_left = false, have_right = false;
+    double left = 0, right = 0;
+
+    if (!accept(&s, '{'))
+        return false;
+
+    do
+    {
+        const char *key;
+        size_t key_length;
+        if (!scan_string(&s, &key, &key_length) || !accept(&s, ':'))
+            return false;
+
+        if (key_length == 4 && !memcmp(key, "type", 4) && !have_type)
+        {
+            const char *type;
+            size_t type_length;
+            if (!scan_string(&s, &type, &type_length) || type_length != 1 || type[0] != WSPROTO_SPEED)
+                return false;
+            have_type = true;
+        }
+        else if (key_length == 4 && !memcmp(key, "left", 4) && !have_left)
+        {
+            if (!scan_number(&s, &left))
+                return false;
+            have_left = true;
+        }
+        else if (key_length == 5 && !memcmp(key, "right", 5) && !have_right)
+        {
+            if (!scan_number(&s, &right))
+                return false;
+            have_right = true;
+        }
+        else
+            return false;
+    } while (accept(&s, ','));
+
+    if (!accept(&s, '}') || !have_type || !have_left || !have_right)
+        return false;
+
+    // Allow a NUL terminator, as sent by some clients
+    skip_whitespace(&s);
+    if (s.next < s.end && !(*s.next == '\0' && s.next + 1 == s.end))
+        return false;
+
+    command->type = WSPROTO_SPEED;
+    command->left = CLAMP(left, -1, 1);
+    command->right = CLAMP(right, -1, 1);
+    return true;
+}
+
+// Parse a "tankbot" text frame. Speed commands in the form sent by the
+// web interface are handled without allocating, and anything else is
+// passed to json-c, which needs the frame to be NUL terminated.
+bool wsproto_parse_json(const char *in, size_t length, struct wsproto_command *command)
+{
+    if (parse_json_speed(in, length, command))
+        return true;
+
+    enum json_tokener_error err;
+    json_object *obj = json_tokener_parse_verbose(in, &err);
+    if (err)
+    {
+        log_warning("JSON parse error: %s\n", json_tokener_error_desc(err));
+        return false;
+    }
+
+    bool valid = false;
+    json_object *type_obj, *left_obj, *right_obj;
+    if (!json_object_object_get_ex(obj, "type", &type_obj))
+        log_warning("Invalid JSON message\n");
+    else if (json_object_get_string(type_obj)[0] == WSPROTO_SPEED)
+    {
+        if (json_object_object_get_ex(obj, "left", &left_obj) &&
+            json_object_object_get_ex(obj, "right", &right_obj))
+        {
+            command->type = WSPROTO_SPEED;
+            command->left = CLAMP(json_object_get_double(left_obj), -1, 1);
+            command->right = CLAMP(json_object_get_double(right_obj), -1, 1);
+            valid = true;
+        }
+        else
+            log_warning("Invalid JSON message\n");
+    }
+
+    json_object_put(obj);
+    return valid;
+}
+
+// Parse a "tankbot-binary" frame
+bool wsproto_parse_binary(const uint8_t *in, size_t length, struct wsproto_command *command)
+{
+    if (length == 0)
+        return false;
+
+    switch (in[0])
+    {
+    case WSPROTO_SPEED:
+        {
+            if (length != sizeof(struct wsproto_speed))
+                break;
+
+            const struct wsproto_speed *speed = (const struct wsproto_speed *)in;
+            command->type = WSPROTO_SPEED;
+            command->left = CLAMP(speed->left / 10000.0, -1, 1);
+            command->right = CLAMP(speed->right / 10000.0, -1, 1);
+            return true;
+        }
+    }
+
+    log_warning("Invalid binary message: type %u, length %zu\n", in[0], length);
+    return false;
+}
+
+// Encode a debug message as a "tankbot" text frame, returning its
+// length, or 0 if it doesn't fit. Bytes outside printable ASCII are
+// escaped so that the frame is always valid UTF-8.
+size_t wsproto_encode_json_message(char *out, size_t size, const char *message, size_t length)
+{
+    static const char prefix[] = "{\"type\":\"m\",\"value\":\"";
+    static const char suffix[] = "\"}";
+    static const char hex[] = "0123456789abcdef";
+
+    if (size < WSPROTO_JSON_MESSAGE_LENGTH(length))
+        return 0;
+
+    char *o = out;
+    memcpy(o, prefix, sizeof(prefix) - 1);
+    o += sizeof(prefix) - 1;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t c = message[i];
+        if (c == '"' || c == '\\')
+        {
+            *o++ = '\\';
+            *o++ = c;
+        }
+        else if (c >= 0x20 && c < 0x7F)
+            *o++ = c;
+        else
+        {
+            memcpy(o, "\\u00", 4);
+            o[4] = hex[c >> 4];
+            o[5] = hex[c & 0xF];
+            o += 6;
+        }
+    }
+
+    memcpy(o, suffix, sizeof(suffix));
+    return o - out + sizeof(suffix) - 1;
+}
+
+// Encode a debug message as a "tankbot-binary" frame, returning its
+// length, or 0 if it doesn't fit
+size_t wsproto_encode_binary_message(uint8_t *out, size_t size, const char *message, size_t length)
+{
+    if (length + WSPROTO_MESSAGE_HEADER_LENGTH > size)
+        return 0;
+
+    out[0] = WSPROTO_MESSAGE;
+    memcpy(&out[WSPROTO_MESSAGE_HEADER_LENGTH], message, length);
+    return length + WSPROTO_MESSAGE_HEADER_LENGTH;
+}
+
+// Encode a gap marker as a "tankbot" text frame, returning its
+// length, or 0 if it doesn't fit
+size_t wsproto_encode_json_gap(char *out, size_t size, uint32_t count)
+{
+    int length = snprintf(out, size, "{\"type\":\"g\",\"count\":%u}", count);
+    return length > 0 && (size_t)length < size ? length : 0;
+}
+
+// Encode a gap marker as a "tankbot-binary" frame, returning its
+// length, or 0 if it doesn't fit
+size_t wsproto_encode_binary_gap(uint8_t *out, size_t size, uint32_t count)
+{
+    if (size < sizeof(struct wsproto_gap))
+        return 0;
+
+    struct wsproto_gap gap = {
+        .type = WSPROTO_GAP,
+        .count = count
+    };
+
+    memcpy(out, &gap, sizeof(struct wsproto_gap));
+    return sizeof(struct wsproto_gap);
+}
+
+// Start a batch in out, which must have space for at least
+// WSPROTO_BATCH_OVERHEAD(1) bytes
+void wsproto_batch_init(struct wsproto_batch *batch, uint8_t *out, size_t size, bool binary)
+{
+    *batch = (struct wsproto_batch) {
+        .out = out,
+        .size = size,
+        .length = 1,
+        .binary = binary
+    };
+
+    out[0] = binary ? WSPROTO_BATCH : '[';
+}
+
+// Find where the next frame should be encoded, and the space available
+// for it, or return NULL if the batch is full
+uint8_t *wsproto_batch_next(struct wsproto_batch *batch, size_t *size)
+{
+    // Binary records start with their length. JSON elements after the
+    // first are separated by a comma, and the array needs a closing ']'.
+    size_t header = batch->binary ? 2 : (batch->count ? 1 : 0);
+    size_t footer = batch->binary ? 0 : 1;
+    if (batch->length + header + footer >= batch->size)
+        return NULL;
+
+    *size = batch->size - batch->length - header - footer;
+    if (batch->binary && *size > UINT16_MAX)
+        *size = UINT16_MAX;
+
+    return &batch->out[batch->length + header];
+}
+
+// Add the frame of the given length written to wsproto_batch_next
+void wsproto_batch_commit(struct wsproto_batch *batch, size_t length)
+{
+    uint8_t *header = &batch->out[batch->length];
+    if (batch->binary)
+    {
+        header[0] = length & 0xFF;
+        header[1] = length >> 8;
+        batch->length += 2;
+    }
+    else if (batch->count)
+    {
+        header[0] = ',';
+        batch->length++;
+    }
+
+    batch->length += length;
+    batch->count++;
+}
+
+// Complete the batch, returning its length
+size_t wsproto_batch_finish(struct wsproto_batch *batch)
+{
+    if (!batch->binary)
+        batch->out[batch->length++] = ']';
+
+    return batch->length;
+}
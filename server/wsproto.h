@@ -0,0 +1,115 @@
+//*****************************************************************************
+//  Messages exchanged with websocket clients
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_WSPROTO_H
+#define TANKBOT_WSPROTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The "tankbot" subprotocol sends JSON text frames:
+//   client -> server: {"type": "S", "left": <-1 - 1>, "right": <-1 - 1>}
+//   server -> client: {"type": "m", "value": <debug message>}
+//                     {"type": "g", "count": <debug messages missed>}
+//                     [<message>, <message>, ...]
+//
+// The "tankbot-binary" subprotocol sends one binary frame per message.
+// The first byte is the message type and the rest has a fixed
+// little-endian layout, given by the structs below.
+//
+// Several messages may be combined into a batch, as a JSON array or a
+// binary frame of type 'b' containing a sequence of records, each a
+// uint16 frame length followed by the frame.
+enum wsproto_type
+{
+    WSPROTO_SPEED = 'S',
+    WSPROTO_MESSAGE = 'm',
+    WSPROTO_GAP = 'g',
+    WSPROTO_BATCH = 'b',
+    WSPROTO_TELEMETRY = 'T'
+};
+
+// Client -> server
+struct __attribute__((__packed__)) wsproto_speed
+{
+    uint8_t type;
+
+    // using -10000 - 10000 to represent fixed point values -1.0000 - 1.0000
+    int16_t left;
+    int16_t right;
+};
+
+// Server -> client. The type byte is followed by the message text,
+// without a terminator.
+#define WSPROTO_MESSAGE_HEADER_LENGTH 1
+
+// Server -> client, sent before the next debug message when a
+// client fell too far behind to receive them all
+struct __attribute__((__packed__)) wsproto_gap
+{
+    uint8_t type;
+    uint32_t count;
+};
+
+// Server -> client, sent periodically
+#define WSPROTO_TELEMETRY_LINK_ACTIVE 0x01
+struct __attribute__((__packed__)) wsproto_telemetry
+{
+    uint8_t type;
+    uint8_t flags;
+
+    // Speed last sent to the avr, in the same units as wsproto_speed
+    int16_t left;
+    int16_t right;
+
+    // Most recent link round-trip time, or 0 if unknown
+    uint32_t rtt_us;
+    uint32_t baud;
+};
+
+// Space needed to JSON encode a debug message of the given length,
+// including a NUL terminator. Escaped bytes expand to six bytes.
+#define WSPROTO_JSON_MESSAGE_LENGTH(length) (6 * (length) + 32)
+
+// Builds a batch frame in a caller-supplied buffer
+struct wsproto_batch
+{
+    uint8_t *out;
+    size_t size;
+    size_t length;
+    size_t count;
+    bool binary;
+};
+
+// Space needed for a batch beyond the frames it contains
+#define WSPROTO_BATCH_OVERHEAD(count) (2 + 2 * (count))
+
+// A decoded client request
+struct wsproto_command
+{
+    enum wsproto_type type;
+    double left;
+    double right;
+};
+
+bool wsproto_parse_json(const char *in, size_t length, struct wsproto_command *command);
+bool wsproto_parse_binary(const uint8_t *in, size_t length, struct wsproto_command *command);
+
+size_t wsproto_encode_json_message(char *out, size_t size, const char *message, size_t length);
+size_t wsproto_encode_binary_message(uint8_t *out, size_t size, const char *message, size_t length);
+void wsproto_batch_init(struct wsproto_batch *batch, uint8_t *out, size_t size, bool binary);
+uint8_t *wsproto_batch_next(struct wsproto_batch *batch, size_t *size);
+void wsproto_batch_commit(struct wsproto_batch *batch, size_t length);
+size_t wsproto_batch_finish(struct wsproto_batch *batch);
+
+size_t wsproto_encode_json_gap(char *out, size_t size, uint32_t count);
+size_t wsproto_encode_binary_gap(uint8_t *out, size_t size, uint32_t count);
+
+#endif
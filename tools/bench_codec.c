@@ -0,0 +1,436 @@
+//*****************************************************************************
+//  Microbenchmarks for the serial packet codec: the framing encoder shared by
+//  server/avr.c and avr/serial.c (queue_data), the server's streaming
+//  decoder, and the firmware's serial_tick parser running on the simulated
+//  hardware. Each packet type is measured with typical, worst-case and
+//  corrupted streams in both framing versions.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../server/decoder.h"
+#include "../avr/serial.h"
+#include "../framing.h"
+#include "../protocol.h"
+#include "hal.h"
+#include "bench_random.h"
+
+// Size of each simulated read from the serial port
+#define READ_CHUNK 64
+
+// Bytes delivered to the firmware between calls to serial_tick. Small
+// enough that the replies to them fit in its 256 byte output buffer,
+// which would otherwise block waiting for the transmit interrupt.
+#define FIRMWARE_CHUNK 8
+
+// Bit error rate of the corrupted streams
+#define CORRUPT_BER 1e-3
+
+// Each measurement repeats until it has used at least this much CPU time
+#define MIN_RUN_NS 50000000ULL
+
+enum stream
+{
+    STREAM_TYPICAL,
+    STREAM_WORST,
+    STREAM_CORRUPT
+};
+
+static const char *stream_names[] = { "typical", "worst", "corrupt" };
+
+struct packet_case
+{
+    enum packet_type type;
+    const char *name;
+
+    // Parsed by the firmware without changing the link state
+    bool firmware;
+};
+
+static const struct packet_case packets[] = {
+    { SPEED, "speed", true },
+    { PING, "ping", true },
+    { PONG, "pong", false },
+    { BAUD, "baud", false },
+    { FRAMING, "framing", false },
+    { MESSAGE, "message", false },
+};
+
+#define PACKET_COUNT (sizeof(packets) / sizeof(packets[0]))
+
+struct result
+{
+    const char *operation;
+    uint8_t version;
+    const char *packet;
+    const char *stream;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t delivered;
+    uint64_t cpu_ns;
+};
+
+static uint64_t cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Packet contents as sent in normal operation, or filled with the byte
+// that costs each framing the most: v1 decoders resynchronize on '$',
+// and every zero byte ends a COBS block in v2
+static uint8_t make_packet(const struct packet_case *p, enum stream stream, uint8_t version,
+                           uint32_t i, uint8_t *data)
+{
+    uint8_t length;
+    switch (p->type)
+    {
+    case SPEED:
+        length = sizeof(struct packet_speed);
+        *(struct packet_speed *)data = (struct packet_speed) {
+            .left = (int16_t)(bench_random() % 20001) - 10000,
+            .right = (int16_t)(bench_random() % 20001) - 10000,
+            .deadline = SPEED_NO_DEADLINE
+        };
+        break;
+    case PING:
+        length = sizeof(struct packet_ping);
+        *(struct packet_ping *)data = (struct packet_ping) { .timestamp = i * 1000000, .sequence = i };
+        break;
+    case PONG:
+        length = sizeof(struct packet_pong);
+        *(struct packet_pong *)data = (struct packet_pong) {
+            .timestamp = i * 1000000, .sequence = i, .clock = i * 1000
+        };
+        break;
+    case BAUD:
+        length = sizeof(struct packet_baud);
+        *(struct packet_baud *)data = (struct packet_baud) { .rate = 1000000, .stage = BAUD_ACCEPT };
+        break;
+    case FRAMING:
+        length = sizeof(struct packet_framing);
+        data[0] = 2;
+        break;
+    default:
+        length = snprintf((char *)data, MAX_MESSAGE_LENGTH, "Speed set to %u%%, %u%%",
+                          (unsigned)(bench_random() % 101), (unsigned)(bench_random() % 101));
+        if (stream == STREAM_WORST)
+            length = MAX_MESSAGE_LENGTH;
+        break;
+    }
+
+    if (stream == STREAM_WORST)
+        memset(data, version == 2 ? 0 : '$', length);
+
+    return length;
+}
+
+static size_t encode(uint8_t *frame, uint8_t version, uint8_t type, uint32_t i, const uint8_t *data, uint8_t length)
+{
+    if (version == 2)
+        return framing_encode_v2(frame, type, i & 0xFF, data, length);
+    return framing_encode_v1(frame, type, data, length);
+}
+
+// Encode count frames into wire, returning its length
+static size_t build_stream(uint8_t *wire, const struct packet_case *p, enum stream stream,
+                           uint8_t version, uint32_t count)
+{
+    size_t length = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t data[MAX_MESSAGE_LENGTH];
+        uint8_t data_length = make_packet(p, stream, version, i, data);
+        length += encode(&wire[length], version, p->type, i, data, data_length);
+    }
+
+    if (stream == STREAM_CORRUPT)
+        bench_flip_bits(wire, length, CORRUPT_BER);
+
+    return length;
+}
+
+static void bench_encode(const struct packet_case *p, enum stream stream, uint8_t version,
+                         uint32_t count, uint8_t *wire, struct result *result)
+{
+    // Generate the packets up front so that only the framing is timed
+    uint8_t (*data)[MAX_MESSAGE_LENGTH] = malloc((size_t)count * MAX_MESSAGE_LENGTH);
+    uint8_t *lengths = malloc(count);
+    for (uint32_t i = 0; i < count; i++)
+        lengths[i] = make_packet(p, stream, version, i, data[i]);
+
+    uint64_t start = cpu_ns();
+    do
+    {
+        size_t offset = 0;
+        for (uint32_t i = 0; i < count; i++)
+            offset += encode(&wire[offset], version, p->type, i, data[i], lengths[i]);
+
+        result->frames += count;
+        result->delivered += count;
+        result->bytes += offset;
+    } while (cpu_ns() - start < MIN_RUN_NS);
+    result->cpu_ns = cpu_ns() - start;
+
+    free(data);
+    free(lengths);
+}
+
+static void bench_decoder(uint8_t version, uint32_t count, const uint8_t *wire, size_t wire_length,
+                          struct result *result)
+{
+    struct decoder *decoder = decoder_new(4096);
+    decoder_set_version(decoder, version);
+
+    uint64_t start = cpu_ns();
+    do
+    {
+        for (size_t offset = 0; offset < wire_length; offset += READ_CHUNK)
+        {
+            size_t space;
+            uint8_t *buf = decoder_write_buffer(decoder, &space);
+            size_t length = wire_length - offset;
+            if (length > READ_CHUNK)
+                length = READ_CHUNK;
+
+            memcpy(buf, &wire[offset], length);
+            decoder_commit(decoder, length);
+
+            struct decoder_frame frame;
+            while (decoder_next(decoder, &frame))
+                result->delivered++;
+        }
+
+        result->frames += count;
+        result->bytes += wire_length;
+    } while (cpu_ns() - start < MIN_RUN_NS);
+    result->cpu_ns = cpu_ns() - start;
+
+    decoder_free(decoder);
+}
+
+// Take everything the firmware has queued for transmission, keeping
+// up to size bytes in out if given. Returns the number of bytes.
+static size_t firmware_drain(uint8_t *out, size_t size)
+{
+    size_t length = 0;
+    int b;
+    while ((b = hal_uart_transmit()) >= 0)
+    {
+        if (out && length < size)
+            out[length] = b;
+        length++;
+    }
+
+    return length;
+}
+
+// Count the frames in a stream sent by the firmware
+static uint64_t count_frames(uint8_t version, const uint8_t *data, size_t length)
+{
+    struct decoder *decoder = decoder_new(4096);
+    decoder_set_version(decoder, version);
+
+    uint64_t frames = 0;
+    for (size_t offset = 0; offset < length; offset += READ_CHUNK)
+    {
+        size_t space;
+        uint8_t *buf = decoder_write_buffer(decoder, &space);
+        size_t n = length - offset < READ_CHUNK ? length - offset : READ_CHUNK;
+        memcpy(buf, &data[offset], n);
+        decoder_commit(decoder, n);
+
+        struct decoder_frame frame;
+        while (decoder_next(decoder, &frame))
+            frames++;
+    }
+
+    decoder_free(decoder);
+    return frames;
+}
+
+static void firmware_receive(const uint8_t *data, size_t length)
+{
+    for (size_t offset = 0; offset < length; offset += FIRMWARE_CHUNK)
+    {
+        size_t end = offset + FIRMWARE_CHUNK < length ? offset + FIRMWARE_CHUNK : length;
+        for (size_t i = offset; i < end; i++)
+            hal_uart_receive(data[i]);
+
+        serial_tick();
+        firmware_drain(NULL, 0);
+    }
+}
+
+// Switch the firmware's framing with a version 1 request, as the server does
+static void firmware_set_version(uint8_t version)
+{
+    uint8_t frame[FRAMING_V1_MAX_LENGTH];
+    struct packet_framing framing = { .version = version };
+    uint8_t length = framing_encode_v1(frame, FRAMING, (const uint8_t *)&framing, sizeof(framing));
+    firmware_receive(frame, length);
+}
+
+// The firmware doesn't report how many packets it parsed, so the replies
+// to the first pass are counted instead: a pong for each ping, and a
+// debug message for each speed or error
+static void bench_firmware(uint8_t version, uint32_t count, const uint8_t *wire, size_t wire_length,
+                           struct result *result)
+{
+    firmware_set_version(version);
+
+    size_t reply_size = (size_t)count * FRAMING_MAX_LENGTH;
+    uint8_t *reply = malloc(reply_size);
+    size_t reply_length = 0;
+    bool first = true;
+
+    uint64_t start = cpu_ns();
+    do
+    {
+        for (size_t offset = 0; offset < wire_length; offset += FIRMWARE_CHUNK)
+        {
+            size_t end = offset + FIRMWARE_CHUNK < wire_length ? offset + FIRMWARE_CHUNK : wire_length;
+            for (size_t i = offset; i < end; i++)
+                hal_uart_receive(wire[i]);
+
+            serial_tick();
+            if (first && reply)
+                reply_length += firmware_drain(&reply[reply_length], reply_size - reply_length);
+            else
+                firmware_drain(NULL, 0);
+        }
+
+        first = false;
+        result->frames += count;
+        result->bytes += wire_length;
+    } while (cpu_ns() - start < MIN_RUN_NS);
+    result->cpu_ns = cpu_ns() - start;
+
+    if (reply_length > reply_size)
+        reply_length = reply_size;
+
+    // Scale to the number of passes, to match the other operations
+    if (reply)
+        result->delivered = count_frames(version, reply, reply_length) * (result->frames / count);
+    free(reply);
+}
+
+static void print_result(const struct result *r, bool csv)
+{
+    double frames_per_second = r->frames * 1e9 / r->cpu_ns;
+    double ns_per_byte = (double)r->cpu_ns / r->bytes;
+    double delivered = (double)r->delivered / r->frames;
+
+    if (csv)
+        printf("%s,%u,%s,%s,%.0f,%.3f,%.3f\n", r->operation, r->version, r->packet, r->stream,
+               frames_per_second, ns_per_byte, delivered);
+    else
+        printf("%-9s %7u  %-8s %-8s %12.0f %9.2f %10.3f\n", r->operation, r->version, r->packet, r->stream,
+               frames_per_second, ns_per_byte, delivered);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = 10000;
+    bool csv = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'c':
+            csv = true;
+            break;
+        default:
+            printf("Usage: bench_codec [-n frames] [-c]\n");
+            printf("  -n <frames>     frames in each stream (default 10000)\n");
+            printf("  -c              print comma separated values\n");
+            printf("Delivered is the fraction of frames decoded, or for the firmware, replies per frame\n");
+            return 1;
+        }
+    }
+
+    if (count < 1)
+        count = 1;
+
+    uint8_t *wire = malloc((size_t)count * FRAMING_MAX_LENGTH);
+    if (!wire)
+    {
+        printf("Failed to allocate %u frames\n", count);
+        return 1;
+    }
+
+    // Start the firmware as main.c does, without the motor startup delay
+    hal_skip_delays = true;
+    serial_initialize();
+    sei();
+    firmware_drain(NULL, 0);
+
+    if (csv)
+        printf("operation,version,packet,stream,frames_per_second,ns_per_byte,delivered\n");
+    else
+    {
+        printf("%u frames per stream; CPU time on this host\n", count);
+        printf("%-9s %7s  %-8s %-8s %12s %9s %10s\n", "operation", "version", "packet", "stream",
+               "frames/s", "ns/byte", "delivered");
+    }
+
+    for (uint8_t version = 1; version <= 2; version++)
+    {
+        for (size_t p = 0; p < PACKET_COUNT; p++)
+        {
+            for (enum stream stream = STREAM_TYPICAL; stream <= STREAM_CORRUPT; stream++)
+            {
+                struct result base = {
+                    .version = version,
+                    .packet = packets[p].name,
+                    .stream = stream_names[stream]
+                };
+
+                // Encoding never sees corruption
+                if (stream != STREAM_CORRUPT)
+                {
+                    struct result r = base;
+                    r.operation = "encode";
+                    bench_random_seed(BENCH_RANDOM_DEFAULT_SEED);
+                    bench_encode(&packets[p], stream, version, count, wire, &r);
+                    print_result(&r, csv);
+                }
+
+                bench_random_seed(BENCH_RANDOM_DEFAULT_SEED);
+                size_t wire_length = build_stream(wire, &packets[p], stream, version, count);
+
+                struct result r = base;
+                r.operation = "decode";
+                bench_decoder(version, count, wire, wire_length, &r);
+                print_result(&r, csv);
+
+                if (packets[p].firmware)
+                {
+                    r = base;
+                    r.operation = "firmware";
+                    bench_firmware(version, count, wire, wire_length, &r);
+                    print_result(&r, csv);
+                }
+            }
+        }
+    }
+
+    free(wire);
+    return 0;
+}
@@ -0,0 +1,197 @@
+//*****************************************************************************
+//  Compares version 1 and version 2 serial framing over a simulated link
+//  that flips random bits, measuring throughput and how many corrupted
+//  packets are detected, lost, or delivered to the application.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../server/decoder.h"
+#include "../server/log.h"
+#include "../server/timing.h"
+#include "../framing.h"
+#include "../protocol.h"
+#include "bench_random.h"
+
+// Link rate used to convert wire bytes into time (8N1 at 115200 baud)
+#define LINK_BYTES_PER_SECOND 11520.0
+
+// Size of each simulated read from the serial port
+#define READ_CHUNK 64
+
+struct result
+{
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t corrupt;
+    uint64_t payload_bytes;
+    uint64_t wire_bytes;
+    double decode_ns;
+};
+
+// Deterministic packet contents for index i: alternating speed and
+// debug packets, with the index in the first two data bytes so that
+// the receiver can check what it was given
+static uint8_t make_packet(uint32_t i, uint8_t *type, uint8_t *data)
+{
+    uint8_t length = (i & 1) ? 4 : 16 + (i * 7) % 64;
+    *type = (i & 1) ? SPEED : MESSAGE;
+
+    uint64_t state = i * 0x9E3779B97F4A7C15ULL + 1;
+    for (uint8_t j = 0; j < length; j++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        // Bias towards the bytes that are special to each framing
+        uint8_t r = state >> 56;
+        data[j] = r < 16 ? 0 : r < 32 ? '$' : r;
+    }
+
+    data[0] = i & 0xFF;
+    data[1] = (i >> 8) & 0xFF;
+    return length;
+}
+
+static bool packet_matches(const struct decoder_frame *frame, uint32_t count)
+{
+    if (frame->length < 2)
+        return false;
+
+    uint32_t i = frame->data[0] | (frame->data[1] << 8);
+    if (i >= count)
+        return false;
+
+    uint8_t type, data[MAX_MESSAGE_LENGTH];
+    uint8_t length = make_packet(i, &type, data);
+    return frame->type == type && frame->length == length && !memcmp(frame->data, data, length);
+}
+
+static void run(uint8_t version, uint32_t count, double ber, struct result *result)
+{
+    memset(result, 0, sizeof(struct result));
+
+    // Encode every packet into one wire stream
+    uint8_t *wire = malloc((size_t)count * FRAMING_MAX_LENGTH);
+    size_t wire_length = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t type, data[MAX_MESSAGE_LENGTH];
+        uint8_t length = make_packet(i, &type, data);
+        if (version == 2)
+            wire_length += framing_encode_v2(&wire[wire_length], type, i & 0xFF, data, length);
+        else
+            wire_length += framing_encode_v1(&wire[wire_length], type, data, length);
+        result->payload_bytes += length;
+    }
+
+    result->sent = count;
+    result->wire_bytes = wire_length;
+
+    bench_flip_bits(wire, wire_length, ber);
+
+    struct decoder *decoder = decoder_new(4096);
+    decoder_set_version(decoder, version);
+
+    uint64_t start = timing_now_ns();
+    for (size_t offset = 0; offset < wire_length; offset += READ_CHUNK)
+    {
+        size_t space;
+        uint8_t *buf = decoder_write_buffer(decoder, &space);
+        size_t length = wire_length - offset;
+        if (length > READ_CHUNK)
+            length = READ_CHUNK;
+
+        memcpy(buf, &wire[offset], length);
+        decoder_commit(decoder, length);
+
+        struct decoder_frame frame;
+        while (decoder_next(decoder, &frame))
+        {
+            if (packet_matches(&frame, count))
+                result->delivered++;
+            else
+                result->corrupt++;
+        }
+    }
+
+    result->decode_ns = (double)(timing_now_ns() - start);
+
+    decoder_free(decoder);
+    free(wire);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = 50000;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            printf("Usage: bench_framing [-n packets] [-v]\n");
+            return 1;
+        }
+    }
+
+    if (count < 2)
+        count = 2;
+    if (count > 65536)
+        count = 65536;
+
+    // The decoder logs every error; only show them if asked
+    if (verbose)
+        log_init(LOG_LEVEL_DEBUG);
+
+    const double rates[] = { 0, 1e-6, 1e-5, 1e-4, 1e-3 };
+    const size_t rate_count = sizeof(rates) / sizeof(rates[0]);
+    struct result results[2][sizeof(rates) / sizeof(rates[0])];
+
+    for (uint8_t version = 1; version <= 2; version++)
+    {
+        for (size_t i = 0; i < rate_count; i++)
+        {
+            bench_random_seed(BENCH_RANDOM_DEFAULT_SEED + i);
+            run(version, count, rates[i], &results[version - 1][i]);
+        }
+    }
+
+    log_shutdown();
+
+    printf("%u packets per run, %.0f bytes/s link\n", count, LINK_BYTES_PER_SECOND);
+    printf("version      BER  efficiency  packets/s  decode MB/s   delivered       lost  undetected\n");
+    for (uint8_t version = 1; version <= 2; version++)
+    {
+        for (size_t i = 0; i < rate_count; i++)
+        {
+            const struct result *r = &results[version - 1][i];
+            double link_seconds = r->wire_bytes / LINK_BYTES_PER_SECOND;
+            printf("%7u  %7.0e  %9.1f%%  %9.1f  %11.1f  %10llu  %9llu  %10llu\n",
+                   version, rates[i], 100.0 * r->payload_bytes / r->wire_bytes,
+                   r->delivered / link_seconds, r->wire_bytes * 1e3 / r->decode_ns,
+                   (unsigned long long)r->delivered,
+                   (unsigned long long)(r->sent - r->delivered),
+                   (unsigned long long)r->corrupt);
+        }
+    }
+
+    return 0;
+}
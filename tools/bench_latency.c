@@ -0,0 +1,140 @@
+//*****************************************************************************
+//  Measures the latency between avr_set_speed and the speed packet reaching
+//  the serial line, using a pseudo-terminal in place of the ArduPilot.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../server/avr.h"
+#include "../server/histogram.h"
+#include "../server/log.h"
+#include "../server/timing.h"
+#include "../protocol.h"
+
+#define SPEED_FRAME_LENGTH (sizeof(struct packet_speed) + PACKET_FRAME_OVERHEAD)
+
+// Read exactly length bytes from the pty master
+static int read_frame(int fd, size_t length, int timeout_ms)
+{
+    uint8_t buf[64];
+    size_t received = 0;
+    while (received < length)
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+            return -1;
+
+        ssize_t ret = read(fd, buf, length - received);
+        if (ret <= 0)
+            return -1;
+        received += ret;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = 200;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            printf("Usage: bench_latency [-n samples] [-v]\n");
+            return 1;
+        }
+    }
+
+    if (samples <= 0)
+        samples = 1;
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        printf("Failed to create pseudo-terminal\n");
+        return 1;
+    }
+
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+
+    // The server code is chatty; only show its messages if asked
+    if (verbose)
+        log_init(LOG_LEVEL_DEBUG);
+
+    struct avr *avr = avr_new(ptsname(master), 115200, NULL, NULL);
+    if (!avr)
+    {
+        log_shutdown();
+        printf("Failed to initialize AVR connection\n");
+        return 1;
+    }
+
+    // Send every command immediately
+    avr_set_speed_filter(avr, 0, 0);
+
+    // Give the worker thread time to open the port
+    nanosleep(&(struct timespec){0, 2e8}, NULL);
+
+    static struct histogram latency;
+    int lost = 0;
+    srand(1);
+    for (int i = 0; i < samples; i++)
+    {
+        // Randomize the phase of the command relative to the worker loop
+        nanosleep(&(struct timespec){0, 1000000 + rand() % 4000000}, NULL);
+
+        uint64_t start = timing_now_ns();
+        avr_set_speed(avr, (i % 200) / 100.0 - 1, 1 - (i % 200) / 100.0);
+        if (read_frame(master, SPEED_FRAME_LENGTH, 1000))
+        {
+            lost++;
+            continue;
+        }
+
+        histogram_record(&latency, timing_now_ns() - start);
+    }
+
+    avr_shutdown(avr);
+    avr_free(avr);
+    close(master);
+    log_shutdown();
+
+    if (latency.count == 0)
+    {
+        printf("No frames received\n");
+        return 1;
+    }
+
+    printf("samples: %d (lost %d)\n", samples, lost);
+    printf("min:  %8.1f us\n", latency.min / 1e3);
+    printf("mean: %8.1f us\n", histogram_mean(&latency) / 1e3);
+    printf("p50:  %8.1f us\n", histogram_percentile(&latency, 0.5) / 1e3);
+    printf("p99:  %8.1f us\n", histogram_percentile(&latency, 0.99) / 1e3);
+    printf("max:  %8.1f us\n", latency.max / 1e3);
+    return 0;
+}
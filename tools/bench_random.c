@@ -0,0 +1,39 @@
+//*****************************************************************************
+//  Repeatable random numbers and bit errors for the benchmarks
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include "bench_random.h"
+
+// xorshift64, so that runs are repeatable. The seed must not be zero.
+static uint64_t state = BENCH_RANDOM_DEFAULT_SEED;
+
+void bench_random_seed(uint64_t seed)
+{
+    state = seed;
+}
+
+uint64_t bench_random()
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Flip each bit with probability ber
+void bench_flip_bits(uint8_t *data, size_t length, double ber)
+{
+    if (ber <= 0)
+        return;
+
+    uint64_t threshold = (uint64_t)(ber * 18446744073709551615.0);
+    for (size_t i = 0; i < length; i++)
+        for (uint8_t bit = 0; bit < 8; bit++)
+            if (bench_random() < threshold)
+                data[i] ^= 1 << bit;
+}
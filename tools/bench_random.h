@@ -0,0 +1,22 @@
+//*****************************************************************************
+//  Repeatable random numbers and bit errors for the benchmarks
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef TANKBOT_BENCH_RANDOM_H
+#define TANKBOT_BENCH_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_RANDOM_DEFAULT_SEED 0x2545F4914F6CDD1DULL
+
+void bench_random_seed(uint64_t seed);
+uint64_t bench_random();
+void bench_flip_bits(uint8_t *data, size_t length, double ber);
+
+#endif
@@ -0,0 +1,199 @@
+//*****************************************************************************
+//  Compares the CPU cost of the JSON "tankbot" and binary "tankbot-binary"
+//  websocket subprotocols, for decoding speed commands from clients and
+//  encoding debug messages sent to them.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../server/wsproto.h"
+
+#define MESSAGE_COUNT 64
+
+struct result
+{
+    double cpu_ns;
+    size_t bytes;
+};
+
+static uint64_t cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Frames as sent by the web interface, with varying speeds, and the same
+// frames with an extra key that forces the general json-c parser
+static char json_speeds[MESSAGE_COUNT][64];
+static char json_fallback_speeds[MESSAGE_COUNT][80];
+static struct wsproto_speed binary_speeds[MESSAGE_COUNT];
+static char messages[MESSAGE_COUNT][64];
+
+static void make_inputs()
+{
+    for (int i = 0; i < MESSAGE_COUNT; i++)
+    {
+        double left = (i % 21) / 10.0 - 1;
+        double right = 1 - (i % 13) / 6.0;
+        snprintf(json_speeds[i], sizeof(json_speeds[i]),
+                 "{\"type\":\"S\",\"left\":%.4f,\"right\":%.4f}", left, right);
+        snprintf(json_fallback_speeds[i], sizeof(json_fallback_speeds[i]),
+                 "{\"type\":\"S\",\"left\":%.4f,\"right\":%.4f,\"seq\":%d}", left, right, i);
+
+        binary_speeds[i] = (struct wsproto_speed) {
+            .type = WSPROTO_SPEED,
+            .left = (int16_t)(10000 * left),
+            .right = (int16_t)(10000 * right)
+        };
+
+        snprintf(messages[i], sizeof(messages[i]), "Speed set to %d%%, %d%%",
+                 (int)(100 * left), (int)(100 * right));
+    }
+}
+
+// Check that the fast path agrees exactly with json-c
+static bool verify_json()
+{
+    static const char *numbers[] = {
+        "0", "-0", "1", "-1", "0.5", "-0.1234", "0.0001", "1e-4", "-2.5E-1",
+        "12.5e-2", "0.30000000000000004", "123456789012345e-15", "1E+0", " 0.75 "
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++)
+    {
+        char fast[128], slow[128];
+        snprintf(fast, sizeof(fast), "{ \"left\": %s, \"type\": \"S\", \"right\" :%s }", numbers[i], numbers[i]);
+        snprintf(slow, sizeof(slow), "{\"type\":\"S\",\"left\":%s,\"right\":%s,\"x\":0}", numbers[i], numbers[i]);
+
+        struct wsproto_command a, b;
+        if (!wsproto_parse_json(fast, strlen(fast), &a) || !wsproto_parse_json(slow, strlen(slow), &b) ||
+            a.left != b.left || a.right != b.right)
+        {
+            printf("Mismatch for %s\n", numbers[i]);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+static void bench_json_parse(uint32_t count, const char *inputs, size_t stride, struct result *result, double *checksum)
+{
+    struct wsproto_command command;
+    result->bytes = 0;
+    uint64_t start = cpu_ns();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *in = &inputs[(i % MESSAGE_COUNT) * stride];
+        size_t length = strlen(in);
+        if (wsproto_parse_json(in, length, &command))
+            *checksum += command.left;
+        result->bytes += length;
+    }
+    result->cpu_ns = (double)(cpu_ns() - start) / count;
+}
+
+static void bench_parse(uint32_t count, struct result *fallback, struct result *json, struct result *binary)
+{
+    struct wsproto_command command;
+    double checksum = 0;
+
+    bench_json_parse(count, json_fallback_speeds[0], sizeof(json_fallback_speeds[0]), fallback, &checksum);
+    checksum = 0;
+    bench_json_parse(count, json_speeds[0], sizeof(json_speeds[0]), json, &checksum);
+
+    binary->bytes = 0;
+    uint64_t start = cpu_ns();
+    start = cpu_ns();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const struct wsproto_speed *in = &binary_speeds[i % MESSAGE_COUNT];
+        if (wsproto_parse_binary((const uint8_t *)in, sizeof(struct wsproto_speed), &command))
+            checksum -= command.left;
+        binary->bytes += sizeof(struct wsproto_speed);
+    }
+    binary->cpu_ns = (double)(cpu_ns() - start) / count;
+
+    // Both decoders should agree to within the binary fixed point precision
+    if (checksum > count * 1e-4 || checksum < -(count * 1e-4))
+        printf("Warning: decoders disagree (%f)\n", checksum);
+}
+
+static void bench_encode(uint32_t count, struct result *json, struct result *binary)
+{
+    char out[WSPROTO_JSON_MESSAGE_LENGTH(64)];
+
+    json->bytes = binary->bytes = 0;
+    uint64_t start = cpu_ns();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *message = messages[i % MESSAGE_COUNT];
+        json->bytes += wsproto_encode_json_message(out, sizeof(out), message, strlen(message));
+    }
+    json->cpu_ns = (double)(cpu_ns() - start) / count;
+
+    start = cpu_ns();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *message = messages[i % MESSAGE_COUNT];
+        binary->bytes += wsproto_encode_binary_message((uint8_t *)out, sizeof(out), message, strlen(message));
+    }
+    binary->cpu_ns = (double)(cpu_ns() - start) / count;
+}
+
+static void print_result(const char *name, uint32_t count, const struct result *json, const struct result *binary)
+{
+    printf("%-16s %10.1f  %10.1f  %10.1f  %10.1f  %6.1fx\n", name,
+           json->cpu_ns, (double)json->bytes / count,
+           binary->cpu_ns, (double)binary->bytes / count,
+           json->cpu_ns / binary->cpu_ns);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            printf("Usage: bench_websocket [-n messages]\n");
+            return 1;
+        }
+    }
+
+    if (count < 1)
+        count = 1;
+
+    make_inputs();
+
+    if (!verify_json())
+        return 1;
+
+    struct result parse_fallback, parse_json, parse_binary, encode_json, encode_binary;
+    bench_parse(count, &parse_fallback, &parse_json, &parse_binary);
+    bench_encode(count, &encode_json, &encode_binary);
+
+    printf("%u messages of each type; CPU time per message\n", count);
+    printf("%-16s %10s  %10s  %10s  %10s  %7s\n", "", "JSON ns", "bytes", "binary ns", "bytes", "speedup");
+    print_result("speed (json-c)", count, &parse_fallback, &parse_binary);
+    print_result("speed (receive)", count, &parse_json, &parse_binary);
+    print_result("message (send)", count, &encode_json, &encode_binary);
+    return 0;
+}
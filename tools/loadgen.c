@@ -0,0 +1,661 @@
+//*****************************************************************************
+//  Websocket load generator: opens many "tankbot" sessions against a running
+//  tankbotserver, sends speed commands from some of them and consumes the
+//  debug messages sent to all of them.
+//
+//  Each command carries a unique pair of speeds, which the avr (or the avr
+//  simulator) echoes back as a "Speed set to L%, R%" debug message. Timing
+//  the echo gives the latency from sending a command to the avr applying it
+//  and every client hearing about it.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../server/histogram.h"
+#include "../server/timing.h"
+#include "../server/wsproto.h"
+
+// Largest message accepted from the server
+#define MAX_MESSAGE_LENGTH 65536
+
+// Room for a complete frame and its header
+#define RECEIVE_BUFFER_SIZE (MAX_MESSAGE_LENGTH + 14)
+
+// Speeds are sent in 1% steps, offset by half a step so that the
+// percentage reported by the avr survives rounding
+#define SPEED_STEPS 101
+#define SPEED_KEYS (SPEED_STEPS * SPEED_STEPS)
+
+// Any valid key works, as the reply is not checked
+#define WEBSOCKET_KEY "dGhlIHNhbXBsZSBub25jZQ=="
+
+enum client_state
+{
+    CLIENT_HANDSHAKE,
+    CLIENT_OPEN,
+    CLIENT_CLOSED
+};
+
+struct client
+{
+    int fd;
+    enum client_state state;
+    bool controller;
+    uint64_t next_command;
+
+    uint8_t *in;
+    size_t in_length;
+    uint8_t *message;
+    size_t message_length;
+
+    // The last echo seen, so that keepalive repeats aren't timed
+    int last_key;
+
+    uint64_t commands;
+    uint64_t commands_blocked;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t messages;
+    uint64_t missed;
+    uint64_t telemetry;
+
+    // Time from sending a command to this client receiving its echo
+    struct histogram delivery;
+};
+
+struct loadgen
+{
+    struct client *clients;
+    int client_count;
+    bool binary;
+
+    // When each speed key was last sent, and whether it was echoed yet
+    uint64_t sent_time[SPEED_KEYS];
+    bool echoed[SPEED_KEYS];
+    uint32_t next_key;
+    uint64_t commands_echoed;
+
+    // Time from sending a command to the first client receiving its echo,
+    // and to each client receiving it
+    struct histogram round_trip;
+    struct histogram delivery;
+};
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *result;
+    if (getaddrinfo(host, port, &hints, &result))
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo *a = result; a; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1)
+            continue;
+
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+    return fd;
+}
+
+static bool send_all(int fd, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t ret = send(fd, data, length, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        data += ret;
+        length -= ret;
+    }
+
+    return true;
+}
+
+static bool open_client(struct client *client, const char *host, const char *port, bool binary)
+{
+    client->fd = connect_to(host, port);
+    if (client->fd == -1)
+        return false;
+
+    char request[512];
+    int length = snprintf(request, sizeof(request),
+                          "GET / HTTP/1.1\r\n"
+                          "Host: %s:%s\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: " WEBSOCKET_KEY "\r\n"
+                          "Sec-WebSocket-Protocol: %s\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n",
+                          host, port, binary ? "tankbot-binary" : "tankbot");
+
+    if (!send_all(client->fd, (const uint8_t *)request, length))
+    {
+        close(client->fd);
+        return false;
+    }
+
+    // Send commands immediately, as browsers do
+    int nodelay = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    fcntl(client->fd, F_SETFL, O_NONBLOCK);
+    client->state = CLIENT_HANDSHAKE;
+    client->last_key = -1;
+    return true;
+}
+
+static void close_client(struct client *client)
+{
+    if (client->state != CLIENT_CLOSED)
+        close(client->fd);
+    client->state = CLIENT_CLOSED;
+}
+
+// Send a masked frame, as required for client to server frames.
+// Commands are dropped rather than queued if the socket is full.
+static bool send_frame(struct client *client, uint8_t opcode, const uint8_t *data, size_t length)
+{
+    uint8_t frame[6 + 125];
+    if (length > 125)
+        return false;
+
+    static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    frame[0] = 0x80 | opcode;
+    frame[1] = 0x80 | length;
+    memcpy(&frame[2], mask, 4);
+    for (size_t i = 0; i < length; i++)
+        frame[6 + i] = data[i] ^ mask[i % 4];
+
+    ssize_t ret = send(client->fd, frame, 6 + length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        client->commands_blocked++;
+        return true;
+    }
+
+    // A partial write would corrupt the stream
+    return ret == (ssize_t)(6 + length);
+}
+
+static bool send_command(struct loadgen *loadgen, struct client *client, uint64_t now)
+{
+    uint32_t key = loadgen->next_key++ % SPEED_KEYS;
+    int16_t left = (key % SPEED_STEPS) * 100 + 50;
+    int16_t right = (key / SPEED_STEPS) * 100 + 50;
+
+    uint8_t payload[64];
+    size_t length;
+    if (loadgen->binary)
+    {
+        struct wsproto_speed speed = { .type = WSPROTO_SPEED, .left = left, .right = right };
+        memcpy(payload, &speed, sizeof(speed));
+        length = sizeof(speed);
+    }
+    else
+        length = snprintf((char *)payload, sizeof(payload), "{\"type\":\"S\",\"left\":%.4f,\"right\":%.4f}",
+                          left / 10000.0, right / 10000.0);
+
+    loadgen->sent_time[key] = now;
+    loadgen->echoed[key] = false;
+    client->commands++;
+    return send_frame(client, loadgen->binary ? 0x2 : 0x1, payload, length);
+}
+
+static void handle_debug_message(struct loadgen *loadgen, struct client *client, const char *text, size_t length)
+{
+    client->messages++;
+
+    char message[64];
+    if (length >= sizeof(message))
+        return;
+
+    memcpy(message, text, length);
+    message[length] = '\0';
+
+    unsigned int left, right;
+    if (sscanf(message, "Speed set to %u%%, %u%%", &left, &right) != 2 || left >= SPEED_STEPS || right >= SPEED_STEPS)
+        return;
+
+    int key = left + SPEED_STEPS * right;
+    if (key == client->last_key || !loadgen->sent_time[key])
+        return;
+
+    client->last_key = key;
+    uint64_t latency = timing_now_ns() - loadgen->sent_time[key];
+    histogram_record(&client->delivery, latency);
+    histogram_record(&loadgen->delivery, latency);
+
+    if (!loadgen->echoed[key])
+    {
+        loadgen->echoed[key] = true;
+        loadgen->commands_echoed++;
+        histogram_record(&loadgen->round_trip, latency);
+    }
+}
+
+static void handle_binary_message(struct loadgen *loadgen, struct client *client, const uint8_t *data, size_t length)
+{
+    if (length == 0)
+        return;
+
+    switch (data[0])
+    {
+    case WSPROTO_MESSAGE:
+        handle_debug_message(loadgen, client, (const char *)&data[1], length - 1);
+        break;
+    case WSPROTO_GAP:
+        if (length >= sizeof(struct wsproto_gap))
+        {
+            struct wsproto_gap gap;
+            memcpy(&gap, data, sizeof(gap));
+            client->missed += gap.count;
+        }
+        break;
+    case WSPROTO_TELEMETRY:
+        client->telemetry++;
+        break;
+    case WSPROTO_BATCH:
+        for (size_t i = 1; i + 2 <= length;)
+        {
+            size_t record = data[i] | (data[i + 1] << 8);
+            if (i + 2 + record > length)
+                break;
+
+            handle_binary_message(loadgen, client, &data[i + 2], record);
+            i += 2 + record;
+        }
+        break;
+    }
+}
+
+// Text frames hold one message or an array of them. The server's encoding
+// is fixed, so the fields can be found without a general JSON parser.
+static void handle_text_message(struct loadgen *loadgen, struct client *client, char *text)
+{
+    static const char value[] = "\"type\":\"m\",\"value\":\"";
+    static const char gap[] = "\"type\":\"g\",\"count\":";
+
+    for (char *m = strstr(text, value); m; m = strstr(m, value))
+    {
+        m += sizeof(value) - 1;
+        char *end = strchr(m, '"');
+        if (!end)
+            break;
+
+        handle_debug_message(loadgen, client, m, end - m);
+        m = end;
+    }
+
+    for (char *g = strstr(text, gap); g; g = strstr(g + 1, gap))
+        client->missed += strtoul(g + sizeof(gap) - 1, NULL, 10);
+}
+
+static bool handle_frame(struct loadgen *loadgen, struct client *client, uint8_t opcode, bool fin,
+                         const uint8_t *payload, size_t length)
+{
+    switch (opcode)
+    {
+    case 0x0: // Continuation
+    case 0x1: // Text
+    case 0x2: // Binary
+        if (opcode)
+            client->message_length = 0;
+
+        // Oversized messages are dropped
+        if (client->message_length + length <= MAX_MESSAGE_LENGTH)
+            memcpy(&client->message[client->message_length], payload, length);
+        client->message_length += length;
+        client->frames++;
+
+        if (fin && client->message_length <= MAX_MESSAGE_LENGTH)
+        {
+            if (loadgen->binary)
+                handle_binary_message(loadgen, client, client->message, client->message_length);
+            else
+            {
+                client->message[client->message_length] = '\0';
+                handle_text_message(loadgen, client, (char *)client->message);
+            }
+        }
+        return true;
+    case 0x8: // Close
+        return false;
+    case 0x9: // Ping
+        return send_frame(client, 0xA, payload, length);
+    default:
+        return true;
+    }
+}
+
+// Decode every complete frame in the receive buffer
+static bool parse_frames(struct loadgen *loadgen, struct client *client)
+{
+    size_t offset = 0;
+    while (client->in_length - offset >= 2)
+    {
+        const uint8_t *frame = &client->in[offset];
+        size_t available = client->in_length - offset;
+        size_t header = 2;
+        uint64_t length = frame[1] & 0x7F;
+
+        if (length == 126)
+        {
+            header = 4;
+            if (available < header)
+                break;
+            length = (frame[2] << 8) | frame[3];
+        }
+        else if (length == 127)
+        {
+            header = 10;
+            if (available < header)
+                break;
+            length = 0;
+            for (int i = 0; i < 8; i++)
+                length = (length << 8) | frame[2 + i];
+        }
+
+        // Servers never mask frames
+        if ((frame[1] & 0x80) || length > MAX_MESSAGE_LENGTH)
+            return false;
+
+        if (available < header + length)
+            break;
+
+        if (!handle_frame(loadgen, client, frame[0] & 0x0F, frame[0] & 0x80, &frame[header], length))
+            return false;
+
+        offset += header + length;
+    }
+
+    memmove(client->in, &client->in[offset], client->in_length - offset);
+    client->in_length -= offset;
+    return true;
+}
+
+static bool receive(struct loadgen *loadgen, struct client *client)
+{
+    for (;;)
+    {
+        ssize_t ret = recv(client->fd, &client->in[client->in_length], RECEIVE_BUFFER_SIZE - client->in_length, 0);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        client->in_length += ret;
+        client->bytes += ret;
+
+        if (client->state == CLIENT_HANDSHAKE)
+        {
+            uint8_t *end = memmem(client->in, client->in_length, "\r\n\r\n", 4);
+            if (!end)
+            {
+                if (client->in_length == RECEIVE_BUFFER_SIZE)
+                    return false;
+                continue;
+            }
+
+            if (client->in_length < 12 || memcmp(client->in, "HTTP/1.1 101", 12))
+            {
+                printf("Websocket handshake rejected\n");
+                return false;
+            }
+
+            size_t header = end + 4 - client->in;
+            memmove(client->in, end + 4, client->in_length - header);
+            client->in_length -= header;
+            client->state = CLIENT_OPEN;
+        }
+
+        if (!parse_frames(loadgen, client))
+            return false;
+    }
+}
+
+static void print_latency(const char *name, const struct histogram *h)
+{
+    if (!h->count)
+    {
+        printf("%s: no samples\n", name);
+        return;
+    }
+
+    printf("%s: %llu samples; p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", name,
+           (unsigned long long)h->count, histogram_percentile(h, 0.5) / 1e6, histogram_percentile(h, 0.9) / 1e6,
+           histogram_percentile(h, 0.99) / 1e6, h->max / 1e6);
+}
+
+static void print_report(struct loadgen *loadgen, double seconds, int controllers, bool verbose)
+{
+    struct client totals = { 0 };
+    int closed = 0;
+    for (int i = 0; i < loadgen->client_count; i++)
+    {
+        struct client *c = &loadgen->clients[i];
+        totals.commands += c->commands;
+        totals.commands_blocked += c->commands_blocked;
+        totals.frames += c->frames;
+        totals.bytes += c->bytes;
+        totals.messages += c->messages;
+        totals.missed += c->missed;
+        totals.telemetry += c->telemetry;
+        if (c->state == CLIENT_CLOSED)
+            closed++;
+    }
+
+    printf("%d clients (%d sending commands) using %s for %.1f s; %d closed by the server\n",
+           loadgen->client_count, controllers, loadgen->binary ? "tankbot-binary" : "tankbot", seconds, closed);
+    printf("Commands: %llu sent (%.1f/s), %llu dropped with the socket full, %llu echoed by the avr\n",
+           (unsigned long long)totals.commands, totals.commands / seconds,
+           (unsigned long long)totals.commands_blocked, (unsigned long long)loadgen->commands_echoed);
+    printf("Received: %llu bytes (%.1f kB/s), %llu frames (%.1f/s), %llu debug messages (%.1f/s), "
+           "%llu missed, %llu telemetry\n",
+           (unsigned long long)totals.bytes, totals.bytes / seconds / 1e3,
+           (unsigned long long)totals.frames, totals.frames / seconds,
+           (unsigned long long)totals.messages, totals.messages / seconds,
+           (unsigned long long)totals.missed, (unsigned long long)totals.telemetry);
+
+    print_latency("Command to avr echo (first client)", &loadgen->round_trip);
+    print_latency("Command to avr echo (all clients)", &loadgen->delivery);
+
+    if (!verbose)
+        return;
+
+    printf("%6s %10s %10s %10s %8s %10s %10s %10s\n", "client", "messages", "frames", "missed",
+           "echoes", "p50 ms", "p99 ms", "max ms");
+    for (int i = 0; i < loadgen->client_count; i++)
+    {
+        struct client *c = &loadgen->clients[i];
+        printf("%5d%c %10llu %10llu %10llu %8llu %10.1f %10.1f %10.1f\n", i, c->controller ? '*' : ' ',
+               (unsigned long long)c->messages, (unsigned long long)c->frames, (unsigned long long)c->missed,
+               (unsigned long long)c->delivery.count, histogram_percentile(&c->delivery, 0.5) / 1e6,
+               histogram_percentile(&c->delivery, 0.99) / 1e6, c->delivery.max / 1e6);
+    }
+}
+
+static void print_usage()
+{
+    printf("Usage: loadgen [options]\n");
+    printf("  -H <host>       server address (default 127.0.0.1)\n");
+    printf("  -p <port>       server port (default 7681)\n");
+    printf("  -n <clients>    websocket sessions to open (default 10)\n");
+    printf("  -c <clients>    sessions that send speed commands; the rest only observe (default 1)\n");
+    printf("  -r <rate>       commands per second from each sending session (default 20)\n");
+    printf("  -t <seconds>    test duration (default 10)\n");
+    printf("  -b              use the tankbot-binary subprotocol\n");
+    printf("  -v              report each client\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    const char *port = "7681";
+    int client_count = 10;
+    int controllers = 1;
+    double rate = 20;
+    double duration = 10;
+    bool binary = false;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:n:c:r:t:bvh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'n':
+            client_count = atoi(optarg);
+            break;
+        case 'c':
+            controllers = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        case 'b':
+            binary = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (client_count < 1 || controllers < 0 || controllers > client_count || rate <= 0 || duration <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    struct loadgen *loadgen = calloc(1, sizeof(struct loadgen));
+    if (!loadgen || !(loadgen->clients = calloc(client_count, sizeof(struct client))))
+    {
+        printf("Failed to allocate clients\n");
+        return 1;
+    }
+
+    loadgen->client_count = client_count;
+    loadgen->binary = binary;
+
+    struct pollfd *pollfds = calloc(client_count, sizeof(struct pollfd));
+    if (!pollfds)
+    {
+        printf("Failed to allocate clients\n");
+        return 1;
+    }
+
+    uint64_t interval = (uint64_t)(1e9 / rate);
+    uint64_t start = timing_now_ns();
+    for (int i = 0; i < client_count; i++)
+    {
+        struct client *c = &loadgen->clients[i];
+        c->in = malloc(RECEIVE_BUFFER_SIZE);
+        c->message = malloc(MAX_MESSAGE_LENGTH + 1);
+        if (!c->in || !c->message || !open_client(c, host, port, binary))
+        {
+            printf("Failed to open session %d to %s:%s\n", i, host, port);
+            return 1;
+        }
+
+        // Spread the controllers' commands evenly over each interval
+        c->controller = i < controllers;
+        c->next_command = start + (controllers ? interval * i / controllers : 0);
+    }
+
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    for (uint64_t now = start; now < end; now = timing_now_ns())
+    {
+        uint64_t wake = end;
+        for (int i = 0; i < client_count; i++)
+        {
+            struct client *c = &loadgen->clients[i];
+            if (c->controller && c->state == CLIENT_OPEN)
+            {
+                if (c->next_command <= now)
+                {
+                    if (!send_command(loadgen, c, now))
+                        close_client(c);
+
+                    // Don't try to catch up after a stall
+                    c->next_command += interval;
+                    if (c->next_command < now)
+                        c->next_command = now + interval;
+                }
+
+                if (c->next_command < wake)
+                    wake = c->next_command;
+            }
+
+            pollfds[i] = (struct pollfd) {
+                .fd = c->state == CLIENT_CLOSED ? -1 : c->fd,
+                .events = POLLIN
+            };
+        }
+
+        now = timing_now_ns();
+        int timeout_ms = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        if (poll(pollfds, client_count, timeout_ms) < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < client_count; i++)
+            if (pollfds[i].revents && !receive(loadgen, &loadgen->clients[i]))
+                close_client(&loadgen->clients[i]);
+    }
+
+    double seconds = (timing_now_ns() - start) / 1e9;
+    print_report(loadgen, seconds, controllers, verbose);
+
+    for (int i = 0; i < client_count; i++)
+    {
+        close_client(&loadgen->clients[i]);
+        free(loadgen->clients[i].in);
+        free(loadgen->clients[i].message);
+    }
+
+    free(pollfds);
+    free(loadgen->clients);
+    free(loadgen);
+    return 0;
+}
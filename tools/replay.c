@@ -0,0 +1,349 @@
+//*****************************************************************************
+//  Replays the client commands from a capture recorded with tankbotserver -C
+//  against a serial port, normally the pty of the avr simulator, at the
+//  original rate, a multiple of it, or as fast as possible, then compares
+//  the serial traffic with the original session.
+//
+//  Copyright: 2013 Paul Chote
+//  This file is part of tankbot, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../server/avr.h"
+#include "../server/capture.h"
+#include "../server/log.h"
+#include "../server/timing.h"
+#include "../server/wsproto.h"
+
+// Longest websocket message replayed
+#define MAX_COMMAND_LENGTH 1024
+
+// Time allowed for the link to come up, and for the last commands to
+// reach the avr before the statistics are taken
+#define LINK_TIMEOUT_MS 5000
+#define DRAIN_MS 500
+
+// tankbotserver defaults, so that the avr sees the same traffic
+#define SPEED_EPSILON 0.005
+#define SPEED_KEEPALIVE_MS 500
+#define SPEED_MAX_AGE_MS 250
+#define PING_INTERVAL_MS 1000
+
+struct session_totals
+{
+    uint64_t duration_ns;
+    uint64_t commands;
+    uint64_t serial_sent;
+    uint64_t serial_received;
+};
+
+static uint64_t debug_messages;
+
+static void count_message(void *context, const char *message, size_t length)
+{
+    __atomic_fetch_add(&debug_messages, 1, __ATOMIC_RELAXED);
+}
+
+static void sleep_ms(int ms)
+{
+    nanosleep(&(struct timespec){ ms / 1000, (ms % 1000) * 1000000L }, NULL);
+}
+
+// Sleep until timing_now_ns() reaches deadline
+static void sleep_until(uint64_t deadline)
+{
+    uint64_t now = timing_now_ns();
+    if (deadline > now)
+    {
+        uint64_t ns = deadline - now;
+        nanosleep(&(struct timespec){ ns / 1000000000ULL, ns % 1000000000ULL }, NULL);
+    }
+}
+
+static bool wait_for_link(struct avr *avr)
+{
+    for (int i = 0; i < LINK_TIMEOUT_MS / 10; i++)
+    {
+        struct avr_telemetry telemetry;
+        avr_get_telemetry(avr, &telemetry);
+        if (telemetry.link_active)
+            return true;
+        sleep_ms(10);
+    }
+
+    return false;
+}
+
+// Totals for the recorded session, from its first to its last client message
+static bool scan_capture(const char *path, struct session_totals *totals, uint64_t *first_ns)
+{
+    struct capture_reader *reader = capture_reader_open(path);
+    if (!reader)
+        return false;
+
+    memset(totals, 0, sizeof(struct session_totals));
+    bool started = false;
+    uint64_t last_ns = 0;
+
+    const struct capture_record *record;
+    const uint8_t *data;
+    while (capture_reader_next(reader, &record, &data))
+    {
+        if (record->source == CAPTURE_WEBSOCKET_RECEIVE)
+        {
+            if (!started)
+                *first_ns = record->time_ns;
+            started = true;
+            last_ns = record->time_ns;
+            totals->commands++;
+        }
+
+        // Only count traffic caused by the replayed commands
+        if (!started)
+            continue;
+
+        if (record->source == CAPTURE_SERIAL_SEND)
+            totals->serial_sent += record->length;
+        else if (record->source == CAPTURE_SERIAL_RECEIVE)
+            totals->serial_received += record->length;
+    }
+
+    capture_reader_close(reader);
+    totals->duration_ns = started ? last_ns - *first_ns : 0;
+    return true;
+}
+
+static bool parse_command(const struct capture_record *record, const uint8_t *data, struct wsproto_command *command)
+{
+    if (record->flags & CAPTURE_FLAG_BINARY)
+        return wsproto_parse_binary(data, record->length, command);
+
+    // json-c needs a terminated string
+    char text[MAX_COMMAND_LENGTH + 1];
+    if (record->length > MAX_COMMAND_LENGTH)
+        return false;
+
+    memcpy(text, data, record->length);
+    text[record->length] = '\0';
+    return wsproto_parse_json(text, record->length, command);
+}
+
+// Send the recorded speeds to the avr, scaling the delays between
+// them by 1 / rate, or without delay if rate is 0. The messages are
+// copied to output, if given, so that it can be replayed in turn.
+static bool replay(const char *path, struct avr *avr, double rate, uint64_t first_ns,
+                   struct capture *output, struct session_totals *totals, uint64_t *invalid)
+{
+    struct capture_reader *reader = capture_reader_open(path);
+    if (!reader)
+        return false;
+
+    memset(totals, 0, sizeof(struct session_totals));
+    uint64_t start = timing_now_ns();
+
+    const struct capture_record *record;
+    const uint8_t *data;
+    while (capture_reader_next(reader, &record, &data))
+    {
+        if (record->source != CAPTURE_WEBSOCKET_RECEIVE)
+            continue;
+
+        if (rate > 0)
+            sleep_until(start + (uint64_t)((record->time_ns - first_ns) / rate));
+
+        if (output)
+            capture_write(output, record->source, record->flags, record->session, data, record->length);
+
+        struct wsproto_command command;
+        if (parse_command(record, data, &command) && command.type == WSPROTO_SPEED)
+            avr_set_speed(avr, command.left, command.right);
+        else
+            (*invalid)++;
+
+        totals->commands++;
+    }
+
+    totals->duration_ns = timing_now_ns() - start;
+    capture_reader_close(reader);
+    return true;
+}
+
+static void print_row(const char *name, double recorded, double replayed)
+{
+    printf("%-22s %14.0f %14.0f\n", name, recorded, replayed);
+}
+
+static void print_usage()
+{
+    printf("Usage: replay [options] <capture>\n");
+    printf("  -d <path>       serial port connected to the avr or simulator (default /tmp/tankbot-avr)\n");
+    printf("  -x <rate>       playback speed relative to the recording (default 1, 0 for no delays)\n");
+    printf("  -f <version>    serial framing version: 1 (default) or 2\n");
+    printf("  -B <baud>       fastest baud rate to negotiate (default 1000000, 0 disables)\n");
+    printf("  -o <path>       record the replayed session to this file\n");
+    printf("  -v              show server log messages\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *serial_port = "/tmp/tankbot-avr";
+    const char *output_path = NULL;
+    double rate = 1;
+    int framing_version = 1;
+    uint32_t max_baud = 1000000;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:x:f:B:o:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            serial_port = optarg;
+            break;
+        case 'x':
+            rate = atof(optarg);
+            break;
+        case 'f':
+            framing_version = atoi(optarg);
+            break;
+        case 'B':
+            max_baud = atoi(optarg);
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || rate < 0 || (framing_version != 1 && framing_version != 2))
+    {
+        print_usage();
+        return 1;
+    }
+
+    const char *capture_path = argv[optind];
+    struct session_totals recorded, replayed;
+    uint64_t first_ns = 0;
+    if (!scan_capture(capture_path, &recorded, &first_ns))
+    {
+        printf("Failed to read capture %s\n", capture_path);
+        return 1;
+    }
+
+    if (recorded.commands == 0)
+    {
+        printf("Capture contains no client messages\n");
+        return 1;
+    }
+
+    // The server code is chatty; only show its messages if asked
+    if (verbose)
+        log_init(LOG_LEVEL_DEBUG);
+
+    struct capture *output = NULL;
+    if (output_path && !(output = capture_open(output_path, CAPTURE_DEFAULT_SIZE)))
+    {
+        printf("Failed to open capture %s\n", output_path);
+        log_shutdown();
+        return 1;
+    }
+
+    struct avr *avr = avr_new(serial_port, 115200, count_message, NULL);
+    if (!avr)
+    {
+        printf("Failed to initialize AVR connection\n");
+        if (output)
+            capture_close(output);
+        log_shutdown();
+        return 1;
+    }
+
+    avr_set_speed_filter(avr, SPEED_EPSILON, SPEED_KEEPALIVE_MS);
+    avr_set_speed_max_age(avr, SPEED_MAX_AGE_MS);
+    avr_set_ping_interval(avr, PING_INTERVAL_MS);
+    avr_set_framing(avr, framing_version);
+    avr_set_max_baud(avr, max_baud);
+
+    // A simulator that is already running stays silent until it
+    // receives a packet, so stop the motors to bring up the link
+    avr_set_speed(avr, 0, 0);
+
+    int ret = 1;
+    if (!wait_for_link(avr))
+    {
+        printf("No response from the avr on %s\n", serial_port);
+        goto done;
+    }
+
+    // Leave time for the framing and baud rate negotiation to finish,
+    // so that only the replayed commands are measured
+    sleep_ms(500);
+    if (output)
+        avr_set_capture(avr, output);
+
+    struct avr_transmit_stats transmit_before, transmit_after;
+    struct decoder_stats receive_before, receive_after;
+    avr_get_transmit_stats(avr, &transmit_before);
+    avr_get_receive_stats(avr, &receive_before);
+    uint64_t messages_before = __atomic_load_n(&debug_messages, __ATOMIC_RELAXED);
+
+    uint64_t invalid = 0;
+    if (!replay(capture_path, avr, rate, first_ns, output, &replayed, &invalid))
+    {
+        printf("Failed to read capture %s\n", capture_path);
+        goto done;
+    }
+
+    sleep_ms(DRAIN_MS);
+    avr_get_transmit_stats(avr, &transmit_after);
+    avr_get_receive_stats(avr, &receive_after);
+    replayed.serial_sent = transmit_after.bytes - transmit_before.bytes;
+    replayed.serial_received = receive_after.bytes - receive_before.bytes;
+
+    struct avr_speed_stats speed;
+    avr_get_speed_stats(avr, &speed);
+    struct avr_ping_stats ping;
+    avr_get_ping_stats(avr, &ping);
+
+    printf("%-22s %14s %14s\n", "", "recorded", "replayed");
+    print_row("duration (ms)", recorded.duration_ns / 1e6, replayed.duration_ns / 1e6);
+    print_row("client commands", recorded.commands, replayed.commands);
+    print_row("serial bytes sent", recorded.serial_sent, replayed.serial_sent);
+    print_row("serial bytes received", recorded.serial_received, replayed.serial_received);
+    if (rate > 0)
+        printf("Replayed at %gx; %llu commands not understood\n", rate, (unsigned long long)invalid);
+    else
+        printf("Replayed at full speed; %llu commands not understood\n", (unsigned long long)invalid);
+    printf("Speed: %llu sent, %llu arrived after their deadline\n",
+           (unsigned long long)speed.sent, (unsigned long long)speed.expired);
+    printf("Debug messages: %llu\n",
+           (unsigned long long)(__atomic_load_n(&debug_messages, __ATOMIC_RELAXED) - messages_before));
+    printf("Ping: %llu sent, %llu received; RTT p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           (unsigned long long)ping.sent, (unsigned long long)ping.received,
+           histogram_percentile(&ping.rtt, 0.5) / 1e3, histogram_percentile(&ping.rtt, 0.99) / 1e3,
+           ping.rtt.max / 1e3);
+    ret = 0;
+
+done:
+    avr_shutdown(avr);
+    avr_free(avr);
+    if (output)
+        capture_close(output);
+    log_shutdown();
+    return ret;
+}